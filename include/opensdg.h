@@ -52,6 +52,28 @@ struct osdg_endpoint
 OSDG_API osdg_connection_t osdg_connection_create(void);
 OSDG_API void osdg_connection_destroy(osdg_connection_t client);
 
+/*
+ * Handles are safe to keep and pass around between threads instead of raw pointers.
+ * osdg_handle_acquire() returns NULL for a handle of a destroyed connection;
+ * otherwise the connection stays allocated until osdg_handle_release(), even
+ * if osdg_connection_destroy() is called in the meantime. Lookup is lock-free.
+ * Callbacks are not called any more once osdg_connection_destroy() has been
+ * called; a connection, which is still in use, is closed by it, and the main
+ * loop keeps the memory until it's done with it. The free callback tells when
+ * the connection is really gone, so that user data can be disposed of safely.
+ * The handle table has a fixed size (MAX_HANDLES cmake option, 4096 by default);
+ * osdg_connection_create() fails if that many connections exist, counting
+ * destroyed ones, which are still referenced by handles.
+ */
+typedef unsigned long long osdg_handle_t;
+typedef void(*osdg_free_cb_t)(void *userData);
+
+OSDG_API osdg_handle_t osdg_get_handle(osdg_connection_t conn);
+OSDG_API osdg_connection_t osdg_handle_acquire(osdg_handle_t handle);
+OSDG_API void osdg_handle_release(osdg_connection_t conn);
+/* Called with the user data on any thread, when the last reference is gone */
+OSDG_API void osdg_set_free_callback(osdg_connection_t conn, osdg_free_cb_t f);
+
 OSDG_API void osdg_set_user_data(osdg_connection_t conn, void *data);
 OSDG_API void *osdg_get_user_data(osdg_connection_t conn);
 
@@ -61,6 +83,8 @@ OSDG_API osdg_result_t osdg_connect_to_remote(osdg_connection_t grid, osdg_conne
 OSDG_API osdg_result_t osdg_pair_remote(osdg_connection_t grid, osdg_connection_t peer, const char *otp);
 OSDG_API osdg_result_t osdg_connection_close(osdg_connection_t client);
 OSDG_API osdg_result_t osdg_send_data(osdg_connection_t conn, const void *data, int size);
+/* Largest data size osdg_send_data() accepts on this connection */
+OSDG_API unsigned int osdg_get_max_send_size(osdg_connection_t conn);
 
 enum osdg_connection_state
 {
@@ -79,11 +103,74 @@ typedef osdg_result_t (*osdg_receive_cb_t)(osdg_connection_t conn, const void *d
 OSDG_API void osdg_set_state_change_callback(osdg_connection_t client, osdg_state_cb_t f);
 OSDG_API osdg_result_t osdg_set_receive_data_callback(osdg_connection_t client, osdg_receive_cb_t f);
 
+/*
+ * Receive filters drop unwanted peer packets on the main loop thread, before
+ * the data callback is called. A packet matches a filter if it's at least
+ * offset + length bytes long, (data[offset + i] & mask[i]) == (value[i] & mask[i])
+ * for all i < length, and its total size equals "size", unless it's 0.
+ * Offsets are relative to the data, passed to the receive callback.
+ * Filters are meant to be set up before connecting and stay across reconnects.
+ */
+#define OSDG_MAX_FILTERS       8
+#define OSDG_FILTER_MAX_LENGTH 16
+
+struct osdg_receive_filter
+{
+    unsigned int  offset;
+    unsigned int  length;
+    unsigned int  size;
+    unsigned char value[OSDG_FILTER_MAX_LENGTH];
+    unsigned char mask[OSDG_FILTER_MAX_LENGTH];
+};
+
+/*
+ * Completion queue, an alternative to callbacks. State changes and received data
+ * of connections in completion mode are posted into a ring instead of calling
+ * callbacks. The application reaps them in batches from any thread. Before waiting
+ * for osdg_get_completion_fd() (an eventfd) to become readable, call
+ * osdg_reap_events() until it returns 0. A data event owns its packet buffer,
+ * which must be given back with osdg_event_release(). If the ring is full, or
+ * too many data events haven't been released yet (with static pools, half of
+ * the buffer pool), events are dropped and counted.
+ */
+enum osdg_event_type
+{
+    osdg_event_state,
+    osdg_event_data
+};
+
+struct osdg_event
+{
+    osdg_handle_t              handle;
+    enum osdg_event_type       type;
+    enum osdg_connection_state state;
+    const void                *data;
+    unsigned int               length;
+    void                      *buffer; /* Internal */
+    unsigned int               bufferSize; /* Internal, for releasing the buffer */
+};
+
+OSDG_API void osdg_set_completion_mode(osdg_connection_t conn, int enable);
+OSDG_API int osdg_get_completion_fd(void);
+OSDG_API unsigned int osdg_reap_events(struct osdg_event *events, unsigned int max);
+OSDG_API void osdg_event_release(struct osdg_event *event);
+OSDG_API unsigned int osdg_get_completion_overflows(void);
+
+OSDG_API osdg_result_t osdg_add_receive_filter(osdg_connection_t conn, const struct osdg_receive_filter *filter);
+OSDG_API void osdg_clear_receive_filters(osdg_connection_t conn);
+
 OSDG_API osdg_result_t osdg_get_last_result(osdg_connection_t client);
 OSDG_API int osdg_get_last_errno(osdg_connection_t client);
 OSDG_API const unsigned char *osdg_get_peer_id(osdg_connection_t conn);
 
 OSDG_API osdg_result_t osdg_set_ping_interval(osdg_connection_t conn, unsigned int seconds);
+/* Send TELL together with MSG_FORWARD_REMOTE instead of waiting for MSG_FORWARD_REPLY.
+   Saves one roundtrip per peer connection. Must be set before connecting.
+   EXPERIMENTAL: relies on the forwarder buffering TELL, which arrives before it has
+   sent MSG_FORWARD_REPLY; this has not been verified yet. Unless the library is built
+   with EXPERIMENTAL_FORWARD_PIPELINING cmake option, enabling fails with
+   osdg_invalid_parameters. */
+OSDG_API osdg_result_t osdg_set_forward_pipelining(osdg_connection_t conn, int enable);
 
 OSDG_API osdg_result_t osdg_init(void);
 OSDG_API void osdg_shutdown(void);
@@ -96,6 +183,53 @@ OSDG_API void osdg_shutdown(void);
 
 OSDG_API void osdg_set_log_mask(unsigned int mask);
 
+/*
+ * Rate limiting of noisy messages, state is kept per call site.
+ * Within every interval (in milliseconds) first burst messages are printed.
+ * The rest are sampled with probability 1/sample; 0 suppresses them all.
+ */
+struct osdg_log_ratelimit
+{
+    unsigned long long intervalStart;
+    unsigned int       printed;
+    unsigned int       suppressed;
+};
+
+OSDG_API void osdg_set_log_rate_limit(unsigned int interval, unsigned int burst, unsigned int sample);
+/* Returns number of messages, suppressed since the last printed one, or -1
+   if this one should be suppressed too */
+OSDG_API int osdg_log_ratelimit(struct osdg_log_ratelimit *rl);
+
+/* Structured binary log records, to be formatted later or offline */
+#define OSDG_LOG_MAX_ARGS 3
+
+enum osdg_log_arg_type
+{
+    osdg_log_arg_none,
+    osdg_log_arg_uint,   /* Unsigned decimal */
+    osdg_log_arg_hex,    /* Unsigned hexadecimal */
+    osdg_log_arg_fourcc, /* Packet command, four characters */
+    osdg_log_arg_result  /* osdg_result_t */
+};
+
+struct osdg_log_record
+{
+    unsigned long long timestamp; /* Monotonic clock, milliseconds */
+    unsigned short     event;     /* Event ID, defines the message */
+    unsigned char      mask;      /* OSDG_LOG_* category */
+    unsigned char      argTypes[OSDG_LOG_MAX_ARGS];
+    unsigned int       connId;    /* See osdg_get_connection_id() */
+    unsigned long long args[OSDG_LOG_MAX_ARGS];
+};
+
+typedef void(*osdg_log_record_cb_t)(const struct osdg_log_record *rec);
+
+/* If set, structured events are passed here instead of being printed.
+   Packet log then costs one callback per packet, without any formatting. */
+OSDG_API void osdg_set_log_record_callback(osdg_log_record_cb_t f);
+OSDG_API size_t osdg_format_log_record(char *buffer, size_t len, const struct osdg_log_record *rec);
+OSDG_API unsigned int osdg_get_connection_id(osdg_connection_t conn);
+
 struct osdg_main_loop_callbacks
 {
     void (*mainloop_start)(void);
@@ -104,6 +238,175 @@ struct osdg_main_loop_callbacks
 
 OSDG_API void osdg_set_mainloop_callbacks(const struct osdg_main_loop_callbacks *cb);
 
+/* Main loop thread placement. Zero-initialized structure means OS defaults. */
+struct osdg_thread_placement
+{
+    const int    *cpus;         /* CPUs to pin the thread to */
+    unsigned int  numCpus;      /* 0 means no pinning */
+    int           policy;       /* SCHED_FIFO or SCHED_RR; SCHED_OTHER keeps default scheduling */
+    int           priority;     /* Static priority for SCHED_FIFO and SCHED_RR */
+    unsigned int  localBuffers; /* Number of packet buffers to preallocate by the thread itself,
+                                   so that they reside on its NUMA node */
+};
+
+/* Must be called before osdg_init(); NULL resets to defaults */
+OSDG_API osdg_result_t osdg_set_thread_placement(const struct osdg_thread_placement *placement);
+
+/* Low latency mode: the main loop spins for up to usec microseconds before going
+   to sleep, trading CPU time for reaction time. 0 (default) disables spinning. */
+OSDG_API void osdg_set_busy_poll(unsigned int usec);
+
+/*
+ * Admission control, smoothing CPU load when many peers (re)connect at once.
+ * Limits the number of peer handshakes in progress and MSG_CALL_REMOTE requests
+ * awaiting reply; 0 means unlimited (default). Waiting connections are admitted
+ * in priority order, higher first; priority is taken into account when queueing.
+ */
+OSDG_API void osdg_set_admission_limits(unsigned int maxHandshakes, unsigned int maxCalls);
+OSDG_API void osdg_set_connection_priority(osdg_connection_t conn, int priority);
+
+/*
+ * Adaptive admission limit (AIMD). Starting from minLimit, the limit grows by one
+ * per a window of successfully established peer connections, and drops by 30%
+ * when MSG_CALL_REMOTE replies get slow or the forwarder reports a server error
+ * or FORWARD_PEER_TIMEOUT. Refused calls (e. g. device offline) don't count
+ * either way. Applies to both handshakes and calls, never exceeding fixed
+ * limits above. maxLimit = 0 disables (default).
+ */
+OSDG_API void osdg_set_adaptive_concurrency(unsigned int minLimit, unsigned int maxLimit);
+/* Current adaptive limit, 0 if disabled */
+OSDG_API unsigned int osdg_get_concurrency_limit(void);
+
+/*
+ * Peer tunnel cache. osdg_tunnel_acquire() returns a live tunnel to (peerId, protocol),
+ * opening a new one if there's none; a new tunnel may still be connecting.
+ * A tunnel, released by all its users, stays open until evicted, least recently
+ * used first, in order to stay within global and per-device limits.
+ * Cached tunnels must be released, never closed or destroyed by the application,
+ * and their state and receive callbacks and user data belong to the cache.
+ *
+ * Instead, every user of a tunnel passes its own struct osdg_tunnel_user, whose
+ * callbacks are called on the main loop thread for every state change and every
+ * received packet. The user is registered before a new tunnel starts connecting,
+ * so no event is missed. Joining an existing tunnel gives no event for its current
+ * state, check osdg_get_connection_state() after acquiring. The structure must stay
+ * valid until released; after releasing from the main loop thread (for example,
+ * from a callback) no more callbacks come. The user may be NULL if no events are
+ * needed.
+ */
+typedef void(*osdg_tunnel_state_cb_t)(osdg_connection_t tunnel, enum osdg_connection_state state, void *userData);
+typedef osdg_result_t(*osdg_tunnel_receive_cb_t)(osdg_connection_t tunnel, const void *data, unsigned int length,
+                                                 void *userData);
+
+struct osdg_tunnel_user
+{
+  osdg_tunnel_state_cb_t    changeState; /* May be NULL */
+  osdg_tunnel_receive_cb_t  receiveData; /* May be NULL */
+  void                     *userData;
+  struct osdg_tunnel_user  *next;        /* Internal */
+};
+
+struct osdg_tunnel_cache_stats
+{
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long evictions;
+  unsigned int       tunnels; /* Currently open */
+  unsigned int       idle;    /* Open, but not acquired by anyone */
+};
+
+OSDG_API osdg_result_t osdg_tunnel_acquire(osdg_connection_t grid, const osdg_key_t peerId, const char *protocol,
+                                           struct osdg_tunnel_user *user, osdg_connection_t *tunnel);
+OSDG_API void osdg_tunnel_release(osdg_connection_t tunnel, struct osdg_tunnel_user *user);
+/* Defaults are 32 tunnels, 2 per device; 0 means unlimited */
+OSDG_API void osdg_set_tunnel_cache_limits(unsigned int maxTunnels, unsigned int maxPerDevice);
+OSDG_API void osdg_get_tunnel_cache_stats(struct osdg_tunnel_cache_stats *stats);
+
+/*
+ * Automatic retry of failed peer connections (osdg_connect_to_remote()).
+ * While retrying the connection stays in osdg_connecting state; the application
+ * only sees the final outcome. Nothing is retried while the grid is down; the
+ * peer fails together with it. Retrying is off by default (maxRetries is 0 for
+ * all classes), so every error is reported immediately unless enabled here.
+ * Policies can be changed at any time; attempts already scheduled keep their delay.
+ */
+enum osdg_retry_class
+{
+  osdg_retry_server_error,   /* FORWARD_SERVER_ERROR; usually worth a couple of immediate retries */
+  osdg_retry_peer_timeout,   /* FORWARD_PEER_TIMEOUT; the device may be busy, back off for seconds */
+  osdg_retry_refused,        /* Refused by the grid, e. g. bad token; not going to change by itself */
+  osdg_retry_connect_failed, /* Forwarder unreachable */
+  osdg_retry_class_max
+};
+
+struct osdg_retry_policy
+{
+  unsigned int maxRetries; /* 0 disables retrying */
+  unsigned int delay;      /* Before the first retry, in milliseconds */
+  unsigned int maxDelay;   /* Backoff limit, 0 for none */
+  unsigned int backoff;    /* Delay multiplier for every next retry */
+};
+
+OSDG_API osdg_result_t osdg_set_retry_policy(enum osdg_retry_class cls, const struct osdg_retry_policy *policy);
+
+/*
+ * Periodic polling of many peers. Jobs are spread evenly over their period
+ * with some jitter, and share tunnels via the tunnel cache. The callback is
+ * called on the main loop thread with a connected tunnel, and the job must
+ * eventually be completed by osdg_poll_job_done(), from any thread. Reporting
+ * a change halves the period (down to minPeriod), otherwise it slowly grows
+ * back up to maxPeriod. Periods are in milliseconds.
+ * With STATIC_POOLS build option jobs come from a pool of POOL_JOBS, creating
+ * more returns NULL.
+ */
+typedef struct _osdg_poll_job *osdg_poll_job_t;
+typedef void(*osdg_poll_cb_t)(osdg_poll_job_t job, osdg_connection_t tunnel, void *userData);
+
+OSDG_API osdg_poll_job_t osdg_poll_job_create(osdg_connection_t grid, const osdg_key_t peerId, const char *protocol,
+                                              unsigned int minPeriod, unsigned int maxPeriod,
+                                              osdg_poll_cb_t cb, void *userData);
+OSDG_API void osdg_poll_job_done(osdg_poll_job_t job, int changed);
+OSDG_API void osdg_poll_job_destroy(osdg_poll_job_t job);
+OSDG_API unsigned int osdg_poll_job_get_period(osdg_poll_job_t job);
+
+/*
+ * Send the same data to many peers. Tunnels come from the tunnel cache; at most
+ * "concurrency" of them are being opened at once (0 means no limit of its own,
+ * leaving it to admission control, adaptive or fixed). When all the peers are
+ * done, the callback gets per-peer results, in the order of peers array.
+ * The callback is called on the main loop thread.
+ * Not available with STATIC_POOLS build option, returns osdg_memory_error.
+ */
+typedef void(*osdg_multicast_cb_t)(const osdg_result_t *results, unsigned int count, void *userData);
+
+OSDG_API osdg_result_t osdg_multicast(osdg_connection_t grid, const osdg_key_t *peers, unsigned int count,
+                                      const char *protocol, const void *data, int size,
+                                      unsigned int concurrency, osdg_multicast_cb_t cb, void *userData);
+
+/* Connection table introspection */
+enum osdg_connection_mode
+{
+  osdg_mode_none,
+  osdg_mode_grid,
+  osdg_mode_peer,
+  osdg_mode_pairing
+};
+
+struct osdg_connection_info
+{
+  osdg_connection_t          conn;       /* For identification only, may be already destroyed */
+  enum osdg_connection_mode  mode;
+  enum osdg_connection_state state;
+  osdg_key_t                 peerId;     /* Remote side's public key */
+  unsigned int               rtt;        /* Last PING roundtrip in ms; grid only, -1 if unknown */
+  unsigned int               queueDepth; /* Peers waiting for MSG_REMOTE_REPLY; grid only */
+  unsigned long long         age;        /* Milliseconds since the connection has been started */
+};
+
+/* Copies up to count entries and returns total number of connections in the main loop.
+   Never blocks the main loop; the snapshot is at most one loop iteration old. */
+OSDG_API unsigned int osdg_enumerate_connections(struct osdg_connection_info *buffer, unsigned int count);
+
 OSDG_API void osdg_bin_to_hex(char *hex, size_t hex_size, const unsigned char *bin, size_t bin_size);
 OSDG_API int osdg_hex_to_bin(unsigned char *bin, size_t buffer_size, const unsigned char *hex, size_t hex_size,
                              const char *ignore, size_t *bin_size, const char **end_ptr);
@@ -111,6 +414,34 @@ OSDG_API int osdg_hex_to_bin(unsigned char *bin, size_t buffer_size, const unsig
 OSDG_API size_t osdg_get_last_result_str(osdg_connection_t conn, char *buffer, size_t len);
 OSDG_API const char *osdg_get_result_str(osdg_result_t res);
 
+/* Packet processing stages, timed if the library is built with PROFILE_STAGES */
+enum osdg_stage
+{
+    osdg_stage_recv,     /* recv() in receive_data() */
+    osdg_stage_frame,    /* Whole handle_packet(), including the nested stages below */
+    osdg_stage_decrypt,  /* decryptMESG() */
+    osdg_stage_unpack,   /* Protobuf unpacking of grid messages */
+    osdg_stage_callback, /* Application's data receive and state change callbacks */
+    osdg_stage_encrypt,  /* Encryption in send_MESG_packet() */
+    osdg_stage_send,     /* send() in send_data() */
+    osdg_stage_max
+};
+
+#define OSDG_STAGE_BUCKETS 32
+
+struct osdg_stage_stats
+{
+    unsigned long long count;
+    unsigned long long total;                         /* Nanoseconds */
+    unsigned long long max;                           /* Nanoseconds */
+    unsigned long long histogram[OSDG_STAGE_BUCKETS]; /* Bucket N counts [2^N, 2^(N+1)) ns */
+};
+
+/* Fills in up to count entries, indexed by enum osdg_stage.
+   Returns osdg_invalid_parameters if profiling is not built in. */
+OSDG_API osdg_result_t osdg_get_stage_stats(struct osdg_stage_stats *stats, unsigned int count);
+OSDG_API void osdg_reset_stage_stats(void);
+
 struct osdg_version
 {
     unsigned int major;
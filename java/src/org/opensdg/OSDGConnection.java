@@ -2,7 +2,7 @@ package org.opensdg;
 
 public class OSDGConnection {
 
-    private long m_Conn;
+    private long m_Conn; // Native handle; stale ones are rejected by the library
 
     public OSDGConnection() {
         m_Conn = OpenSDG.connection_create(this);
@@ -41,6 +41,15 @@ public class OSDGConnection {
         return OSDGResult.fromNative(OpenSDG.send_data(m_Conn, data));
     }
 
+    // Packets matching a filter are dropped before onDataReceived() is called
+    public OSDGResult AddReceiveFilter(int offset, byte[] value, byte[] mask, int size) {
+        return OSDGResult.fromNative(OpenSDG.add_receive_filter(m_Conn, offset, value, mask, size));
+    }
+
+    public void ClearReceiveFilters() {
+        OpenSDG.clear_receive_filters(m_Conn);
+    }
+
     public void SetBlockingMode(boolean blocking) {
         OpenSDG.set_blocking_mode(m_Conn, blocking);
     }
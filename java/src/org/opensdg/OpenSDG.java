@@ -54,6 +54,10 @@ public class OpenSDG {
 
     native static int send_data(long conn, byte[] data);
 
+    native static int add_receive_filter(long conn, int offset, byte[] value, byte[] mask, int size);
+
+    native static void clear_receive_filters(long conn);
+
     native static void set_blocking_mode(long conn, boolean blocking);
 
     native static boolean get_blocking_mode(long conn);
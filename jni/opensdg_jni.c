@@ -50,6 +50,16 @@ JNIEXPORT jint JNICALL Java_org_opensdg_OpenSDG_init(JNIEnv *env, jclass cl)
     return res;
 }
 
+/*
+ * Java keeps connection handles, not pointers. A call on a destroyed connection
+ * fails instead of touching freed memory, and the connection can't be freed
+ * while a call is in progress.
+ */
+#define ACQUIRE(var, handle, fail)                          \
+    osdg_connection_t var = osdg_handle_acquire(handle);    \
+    if (!var)                                               \
+        return fail
+
 static jbyte *getNativeKey(JNIEnv *env, jbyteArray key)
 {
     if ((*env)->GetArrayLength(env, key) != sizeof(osdg_key_t))
@@ -60,10 +70,12 @@ static jbyte *getNativeKey(JNIEnv *env, jbyteArray key)
 
 JNIEXPORT void JNICALL Java_org_opensdg_OpenSDG_set_1private_1key(JNIEnv *env, jclass cl, jlong conn, jbyteArray key)
 {
+    ACQUIRE(c, conn, );
     jbyte *nativeKey = getNativeKey(env, key);
     
-    osdg_set_private_key((osdg_connection_t)(uintptr_t)conn, nativeKey);
+    osdg_set_private_key(c, nativeKey);
     (*env)->ReleaseByteArrayElements(env, key, nativeKey, 0);
+    osdg_handle_release(c);
 }
 
 static jbyteArray makeJavaArray(JNIEnv *env, const void *data, unsigned int len)
@@ -81,7 +93,11 @@ static jbyteArray makeJavaKey(JNIEnv *env, const osdg_key_t nativeKey)
 
 JNIEXPORT jbyteArray JNICALL Java_org_opensdg_OpenSDG_get_1my_1peer_1id(JNIEnv *env, jclass cl, jlong conn)
 {
-    return makeJavaKey(env, osdg_get_my_peer_id((osdg_connection_t)(uintptr_t)conn));
+    ACQUIRE(c, conn, NULL);
+    jbyteArray ret = makeJavaKey(env, osdg_get_my_peer_id(c));
+
+    osdg_handle_release(c);
+    return ret;
 }
 
 JNIEXPORT jbyteArray JNICALL Java_org_opensdg_OpenSDG_CreatePrivateKey(JNIEnv *env, jclass cl)
@@ -110,9 +126,13 @@ static jmethodID GetObjectMethodID(JNIEnv *env, jobject obj, const char *name, c
 static void connection_state_change(osdg_connection_t conn, enum osdg_connection_state state)
 {
     JNIEnv *env = NULL;
-    jobject obj = osdg_get_user_data((osdg_connection_t)(uintptr_t)conn);
+    jobject obj = osdg_get_user_data(conn);
     static jmethodID mid;
 
+    /* Java object is gone, nobody to tell */
+    if (!obj)
+        return;
+
     (*jvm)->GetEnv(jvm, (void **)&env, JNI_VERSION_1_4);
 
     if (!mid)
@@ -124,11 +144,14 @@ static void connection_state_change(osdg_connection_t conn, enum osdg_connection
 static osdg_result_t connection_receive_data(osdg_connection_t conn, const void *data, unsigned int len)
 {
     JNIEnv *env = NULL;
-    jobject obj = osdg_get_user_data((osdg_connection_t)(uintptr_t)conn);
+    jobject obj = osdg_get_user_data(conn);
     jbyteArray jData;
     osdg_result_t res;
     static jmethodID mid;
 
+    if (!obj)
+        return osdg_no_error;
+
     (*jvm)->GetEnv(jvm, (void **)&env, JNI_VERSION_1_4);
 
     if (!mid)
@@ -141,6 +164,18 @@ static osdg_result_t connection_receive_data(osdg_connection_t conn, const void
     return res;
 }
 
+/* The library calls this when no callback can come any more */
+static void connection_free_user_data(void *userData)
+{
+    JNIEnv *env = NULL;
+
+    if (!userData)
+        return;
+
+    (*jvm)->GetEnv(jvm, (void **)&env, JNI_VERSION_1_4);
+    (*env)->DeleteWeakGlobalRef(env, userData);
+}
+
 JNIEXPORT jlong JNICALL Java_org_opensdg_OpenSDG_connection_1create(JNIEnv *env, jclass cl, jobject jConn)
 {
     osdg_connection_t conn = osdg_connection_create();
@@ -150,92 +185,189 @@ JNIEXPORT jlong JNICALL Java_org_opensdg_OpenSDG_connection_1create(JNIEnv *env,
         osdg_set_user_data(conn, (*env)->NewWeakGlobalRef(env, jConn));
         osdg_set_state_change_callback(conn, connection_state_change);
         osdg_set_receive_data_callback(conn, connection_receive_data);
+        osdg_set_free_callback(conn, connection_free_user_data);
     }
 
-    return (uintptr_t)conn;
+    return conn ? (jlong)osdg_get_handle(conn) : 0;
 }
 
 JNIEXPORT void JNICALL Java_org_opensdg_OpenSDG_connection_1destroy(JNIEnv *env, jclass cl, jlong conn)
 {
-    jweak jConn = osdg_get_user_data((osdg_connection_t)(uintptr_t)conn);
+    ACQUIRE(c, conn, );
 
-    (*env)->DeleteWeakGlobalRef(env, jConn);
-    osdg_connection_destroy((osdg_connection_t)(uintptr_t)conn);
+    /* No callbacks after this; the weak reference goes with the last handle reference */
+    osdg_connection_destroy(c);
+    osdg_handle_release(c);
 }
 
 JNIEXPORT jint JNICALL Java_org_opensdg_OpenSDG_connect_1to_1danfoss(JNIEnv *env, jclass cl, jlong conn)
 {
-    return osdg_connect_to_danfoss((osdg_connection_t)(uintptr_t)conn);
+    ACQUIRE(c, conn, osdg_invalid_parameters);
+    jint ret = osdg_connect_to_danfoss(c);
+
+    osdg_handle_release(c);
+    return ret;
 }
 
 JNIEXPORT jint JNICALL Java_org_opensdg_OpenSDG_connect_1to_1remote(JNIEnv *env, jclass cl, jlong grid, jlong peer, jbyteArray peerId, jstring protocol)
 {
-    unsigned char *nativeKey = getNativeKey(env, peerId);
-    const char *nativeProto = (*env)->GetStringUTFChars(env, protocol, NULL);
-    osdg_result_t res = osdg_connect_to_remote((osdg_connection_t)(uintptr_t)grid, (osdg_connection_t)(uintptr_t)peer, nativeKey, nativeProto);
+    ACQUIRE(g, grid, osdg_invalid_parameters);
+    osdg_connection_t p = osdg_handle_acquire(peer);
+    unsigned char *nativeKey;
+    const char *nativeProto;
+    osdg_result_t res;
+
+    if (!p)
+    {
+        osdg_handle_release(g);
+        return osdg_invalid_parameters;
+    }
+
+    nativeKey = getNativeKey(env, peerId);
+    nativeProto = (*env)->GetStringUTFChars(env, protocol, NULL);
+    res = osdg_connect_to_remote(g, p, nativeKey, nativeProto);
 
     (*env)->ReleaseByteArrayElements(env, peerId, nativeKey, 0);
     (*env)->ReleaseStringUTFChars(env, protocol, nativeProto);
+    osdg_handle_release(p);
+    osdg_handle_release(g);
     return res;
 }
 
 JNIEXPORT jint JNICALL Java_org_opensdg_OpenSDG_pair_1remote(JNIEnv *env, jclass cl, jlong grid, jlong peer, jstring otp)
 {
-    const char *nativeOtp = (*env)->GetStringUTFChars(env, otp, NULL);
-    osdg_result_t res = osdg_pair_remote((osdg_connection_t)(uintptr_t)grid, (osdg_connection_t)(uintptr_t)peer, nativeOtp);
+    ACQUIRE(g, grid, osdg_invalid_parameters);
+    osdg_connection_t p = osdg_handle_acquire(peer);
+    const char *nativeOtp;
+    osdg_result_t res;
+
+    if (!p)
+    {
+        osdg_handle_release(g);
+        return osdg_invalid_parameters;
+    }
+
+    nativeOtp = (*env)->GetStringUTFChars(env, otp, NULL);
+    res = osdg_pair_remote(g, p, nativeOtp);
 
     (*env)->ReleaseStringUTFChars(env, otp, nativeOtp);
+    osdg_handle_release(p);
+    osdg_handle_release(g);
     return res;
 }
 
 JNIEXPORT jint JNICALL Java_org_opensdg_OpenSDG_connection_1close(JNIEnv *env, jclass cl, jlong conn)
 {
-    return osdg_connection_close((osdg_connection_t)(uintptr_t)conn);
+    ACQUIRE(c, conn, osdg_invalid_parameters);
+    jint ret = osdg_connection_close(c);
+
+    osdg_handle_release(c);
+    return ret;
 }
 
 JNIEXPORT jint JNICALL Java_org_opensdg_OpenSDG_send_1data(JNIEnv *env, jclass cl, jlong conn, jbyteArray data)
 {
+    ACQUIRE(c, conn, osdg_invalid_parameters);
     jbyte *nativeData = (*env)->GetByteArrayElements(env, data, NULL);
     jsize size = (*env)->GetArrayLength(env, data);
-    osdg_result_t res = osdg_send_data((osdg_connection_t)(uintptr_t)conn, nativeData, size);
+    osdg_result_t res = osdg_send_data(c, nativeData, size);
 
     (*env)->ReleaseByteArrayElements(env, data, nativeData, 0);
+    osdg_handle_release(c);
     return res;
 }
 
+JNIEXPORT jint JNICALL Java_org_opensdg_OpenSDG_add_1receive_1filter(JNIEnv *env, jclass cl, jlong conn, jint offset,
+                                                                      jbyteArray value, jbyteArray mask, jint size)
+{
+    ACQUIRE(c, conn, osdg_invalid_parameters);
+    struct osdg_receive_filter filter;
+    jsize length = (*env)->GetArrayLength(env, value);
+    osdg_result_t res = osdg_invalid_parameters;
+
+    if (offset >= 0 && size >= 0 && length <= OSDG_FILTER_MAX_LENGTH && (*env)->GetArrayLength(env, mask) == length)
+    {
+        filter.offset = offset;
+        filter.length = length;
+        filter.size   = size;
+        (*env)->GetByteArrayRegion(env, value, 0, length, (jbyte *)filter.value);
+        (*env)->GetByteArrayRegion(env, mask, 0, length, (jbyte *)filter.mask);
+
+        res = osdg_add_receive_filter(c, &filter);
+    }
+
+    osdg_handle_release(c);
+    return res;
+}
+
+JNIEXPORT void JNICALL Java_org_opensdg_OpenSDG_clear_1receive_1filters(JNIEnv *env, jclass cl, jlong conn)
+{
+    ACQUIRE(c, conn, );
+
+    osdg_clear_receive_filters(c);
+    osdg_handle_release(c);
+}
+
 JNIEXPORT void JNICALL Java_org_opensdg_OpenSDG_set_1blocking_1mode(JNIEnv *env, jclass cl, jlong conn, jboolean blocking)
 {
-    osdg_set_blocking_mode((osdg_connection_t)(uintptr_t)conn, blocking);
+    ACQUIRE(c, conn, );
+
+    osdg_set_blocking_mode(c, blocking);
+    osdg_handle_release(c);
 }
 
 JNIEXPORT jboolean JNICALL Java_org_opensdg_OpenSDG_get_1blocking_1mode(JNIEnv *env, jclass cl, jlong conn)
 {
-    return osdg_get_blocking_mode((osdg_connection_t)(uintptr_t)conn);
+    ACQUIRE(c, conn, 0);
+    jboolean ret = osdg_get_blocking_mode(c);
+
+    osdg_handle_release(c);
+    return ret;
 }
 
 JNIEXPORT jint JNICALL Java_org_opensdg_OpenSDG_get_1connection_1state(JNIEnv *env, jclass cl, jlong conn)
 {
-    return osdg_get_connection_state((osdg_connection_t)(uintptr_t)conn);
+    ACQUIRE(c, conn, osdg_closed);
+    jint ret = osdg_get_connection_state(c);
+
+    osdg_handle_release(c);
+    return ret;
 }
 
 JNIEXPORT jint JNICALL Java_org_opensdg_OpenSDG_get_1last_1result(JNIEnv * env, jclass cl, jlong conn)
 {
-    return osdg_get_last_result((osdg_connection_t)(uintptr_t)conn);
+    ACQUIRE(c, conn, osdg_invalid_parameters);
+    jint ret = osdg_get_last_result(c);
+
+    osdg_handle_release(c);
+    return ret;
 }
 
 JNIEXPORT jint JNICALL Java_org_opensdg_OpenSDG_get_1last_1errno(JNIEnv *env, jclass cl, jlong conn)
 {
-    return osdg_get_last_errno((osdg_connection_t)(uintptr_t)conn);
+    ACQUIRE(c, conn, 0);
+    jint ret = osdg_get_last_errno(c);
+
+    osdg_handle_release(c);
+    return ret;
 }
 
 JNIEXPORT jbyteArray JNICALL Java_org_opensdg_OpenSDG_get_1peer_1id(JNIEnv *env, jclass cl, jlong conn)
 {
-    return makeJavaKey(env, osdg_get_peer_id((osdg_connection_t)(uintptr_t)conn));
+    ACQUIRE(c, conn, NULL);
+    jbyteArray ret = makeJavaKey(env, osdg_get_peer_id(c));
+
+    osdg_handle_release(c);
+    return ret;
 }
 
 JNIEXPORT jint JNICALL Java_org_opensdg_OpenSDG_set_1ping_1interval(JNIEnv *env, jclass cl, jlong conn, jint seconds)
 {
-    return osdg_set_ping_interval((osdg_connection_t)(uintptr_t)conn, seconds);
+    ACQUIRE(c, conn, osdg_invalid_parameters);
+    jint ret = osdg_set_ping_interval(c, seconds);
+
+    osdg_handle_release(c);
+    return ret;
 }
 
 JNIEXPORT jstring JNICALL Java_org_opensdg_OpenSDG_get_1result_1str(JNIEnv *env, jclass cl, jint res)
@@ -246,17 +378,22 @@ JNIEXPORT jstring JNICALL Java_org_opensdg_OpenSDG_get_1result_1str(JNIEnv *env,
 
 JNIEXPORT jstring JNICALL Java_org_opensdg_OpenSDG_get_1last_1result_1str(JNIEnv *env, jclass cl, jlong conn)
 {
-    size_t len = osdg_get_last_result_str((osdg_connection_t)(uintptr_t)conn, NULL, 0);
+    ACQUIRE(c, conn, NULL);
+    size_t len = osdg_get_last_result_str(c, NULL, 0);
     char *buffer = malloc(len);
     jstring ret;
 
     /* We should never hit this */
     if (!buffer)
+    {
+        osdg_handle_release(c);
         return (*env)->NewStringUTF(env, "String buffer allocation failed");
+    }
 
-    osdg_get_last_result_str((osdg_connection_t)(uintptr_t)conn, buffer, len);       
+    osdg_get_last_result_str(c, buffer, len);
     ret = (*env)->NewStringUTF(env, buffer);
     free(buffer);
+    osdg_handle_release(c);
     return ret;
 }
 
@@ -0,0 +1,283 @@
+#include "admission.h"
+#include "atomic_wrapper.h"
+#include "client.h"
+#include "logging.h"
+
+static unsigned int maxHandshakes; /* 0 means unlimited */
+static unsigned int maxCalls;
+static unsigned int handshakes;
+static unsigned int calls;
+static int          dispatching;
+
+/* Adaptive limit, disabled if adaptiveMax is 0 */
+#define ADAPTIVE_SLACK 50 /* ms of latency jitter, tolerated on top of 2x base */
+
+static unsigned int adaptiveMin;
+static unsigned int adaptiveMax;
+static unsigned int adaptiveLimit;
+static unsigned int successes;    /* Since the last increase */
+static timestamp_t  baseLatency;  /* Best recent MSG_CALL_REMOTE roundtrip */
+static timestamp_t  lastLatency;
+static timestamp_t  lastDecrease;
+
+/* Sorted by priority, FIFO within the same priority */
+static struct list waitQueue =
+{
+    (struct list_element *)&waitQueue.stop,
+    NULL,
+    (struct list_element *)&waitQueue.head
+};
+
+void osdg_set_admission_limits(unsigned int handshakeLimit, unsigned int callLimit)
+{
+    atomic_write(&maxHandshakes, handshakeLimit);
+    atomic_write(&maxCalls, callLimit);
+    /* Let the main loop admit waiting connections if limits were raised */
+    mainloop_client_event();
+}
+
+void osdg_set_adaptive_concurrency(unsigned int minLimit, unsigned int maxLimit)
+{
+    if (maxLimit && !minLimit)
+        minLimit = 1;
+    if (maxLimit && maxLimit < minLimit)
+        maxLimit = minLimit;
+
+    atomic_write(&adaptiveMin, minLimit);
+    atomic_write(&adaptiveMax, maxLimit);
+    mainloop_client_event();
+}
+
+unsigned int osdg_get_concurrency_limit(void)
+{
+    return atomic_read(&adaptiveMax) ? atomic_read(&adaptiveLimit) : 0;
+}
+
+void osdg_set_connection_priority(osdg_connection_t conn, int priority)
+{
+    conn->priority = priority;
+}
+
+static inline struct _osdg_connection *get_waiting_connection(struct list_element *e)
+{
+    return (struct _osdg_connection *)((char *)e - offsetof(struct _osdg_connection, admissionReq));
+}
+
+/* Current adaptive limit, clamped to the configured range; 0 if disabled */
+static unsigned int adaptive_limit(void)
+{
+    unsigned int min = atomic_read(&adaptiveMin);
+    unsigned int max = atomic_read(&adaptiveMax);
+    unsigned int limit = adaptiveLimit;
+
+    if (!max)
+        return 0;
+
+    if (limit < min)
+        limit = min;
+    else if (limit > max)
+        limit = max;
+
+    if (limit != adaptiveLimit)
+        atomic_write(&adaptiveLimit, limit);
+
+    return limit;
+}
+
+/* Additive increase: one more slot per a full window of successes */
+static void adaptive_success(void)
+{
+    unsigned int limit = adaptive_limit();
+
+    if (!limit || ++successes < limit)
+        return;
+
+    successes = 0;
+    if (limit < atomic_read(&adaptiveMax))
+    {
+        atomic_write(&adaptiveLimit, limit + 1);
+        LOG(CONNECTION, "Adaptive concurrency limit raised to %u", limit + 1);
+    }
+}
+
+/* Multiplicative decrease, once per roundtrip, so a burst of bad replies counts once */
+static void adaptive_congestion(const char *reason)
+{
+    unsigned int limit = adaptive_limit();
+    timestamp_t now = timestamp();
+
+    if (!limit || now - lastDecrease < lastLatency)
+        return;
+
+    lastDecrease = now;
+    successes = 0;
+    limit = limit * 7 / 10;
+    if (limit < atomic_read(&adaptiveMin))
+        limit = atomic_read(&adaptiveMin);
+
+    atomic_write(&adaptiveLimit, limit);
+    LOG(CONNECTION, "Adaptive concurrency limit lowered to %u (%s)", limit, reason);
+}
+
+void admission_call_done(struct _osdg_connection *conn, int ok)
+{
+    timestamp_t latency = timestamp() - conn->callStart;
+
+    lastLatency = latency;
+
+    /* An offline or unknown device says nothing about the grid's load */
+    if (!ok)
+        return;
+
+    /* Track the best latency, slowly drifting up in case the path has changed */
+    if (!baseLatency || latency < baseLatency)
+        baseLatency = latency;
+    else
+        baseLatency += (latency - baseLatency) / 64;
+
+    /* Success is counted once per connection, when the handshake completes */
+    if (latency > baseLatency * 2 + ADAPTIVE_SLACK)
+        adaptive_congestion("latency");
+}
+
+static int admission_available(unsigned char slot)
+{
+    unsigned int adaptive = adaptive_limit();
+    unsigned int limit, used;
+
+    if (slot == ADMIT_CALL)
+    {
+        limit = atomic_read(&maxCalls);
+        used  = calls;
+    }
+    else
+    {
+        limit = atomic_read(&maxHandshakes);
+        used  = handshakes;
+    }
+
+    /* The adaptive limit never goes above the fixed one */
+    if (adaptive && (!limit || adaptive < limit))
+        limit = adaptive;
+
+    return !limit || used < limit;
+}
+
+static void admission_take(struct _osdg_connection *conn, unsigned char slot)
+{
+    conn->admission |= slot;
+    if (slot == ADMIT_CALL)
+        calls++;
+    else
+        handshakes++;
+}
+
+int admission_acquire(struct _osdg_connection *conn, unsigned char slot)
+{
+    struct list_element *e;
+
+    if (admission_available(slot))
+    {
+        admission_take(conn, slot);
+        return 1;
+    }
+
+    for (e = waitQueue.head; e->next; e = e->next)
+    {
+        if (get_waiting_connection(e)->priority < conn->priority)
+            break;
+    }
+
+    LOG(CONNECTION, "Conn[%u] queued for admission, %s", conn->connId,
+        slot == ADMIT_CALL ? "call" : "handshake");
+
+    conn->admissionWait = slot;
+    list_insert_before(&conn->admissionReq, e);
+    return 0;
+}
+
+void admission_release_slot(struct _osdg_connection *conn, unsigned char slot)
+{
+    if (!(conn->admission & slot))
+        return;
+
+    conn->admission &= ~slot;
+    if (slot == ADMIT_CALL)
+        calls--;
+    else
+        handshakes--;
+
+    admission_run();
+}
+
+void admission_release(struct _osdg_connection *conn)
+{
+    if (conn->admissionWait)
+    {
+        list_remove(&conn->admissionReq);
+        conn->admissionWait = 0;
+    }
+
+    if (conn->admission & ADMIT_CALL)
+        calls--;
+    if (conn->admission & ADMIT_HANDSHAKE)
+    {
+        handshakes--;
+
+        /* These are the grid telling us to slow down */
+        if (conn->state == osdg_connected)
+            adaptive_success();
+        else if (conn->errorKind == osdg_server_error || conn->errorKind == osdg_peer_timeout)
+            adaptive_congestion("forward error");
+    }
+    conn->admission = 0;
+
+    admission_run();
+}
+
+static void admission_admit(struct _osdg_connection *conn, unsigned char slot)
+{
+    int ret;
+
+    LOG(CONNECTION, "Conn[%u] admitted, %s", conn->connId, slot == ADMIT_CALL ? "call" : "handshake");
+
+    admission_take(conn, slot);
+    ret = slot == ADMIT_CALL ? peer_send_call_remote(conn) : peer_connect_tunnel(conn);
+    if (ret)
+        connection_terminate(conn, osdg_error);
+}
+
+void admission_run(void)
+{
+    int admitted;
+
+    /* Admitting may terminate connections, which calls us back */
+    if (dispatching)
+        return;
+    dispatching = 1;
+
+    do
+    {
+        struct list_element *e;
+
+        admitted = 0;
+
+        /* Start over every time, the queue could have changed under our feet */
+        for (e = waitQueue.head; e->next; e = e->next)
+        {
+            struct _osdg_connection *conn = get_waiting_connection(e);
+            unsigned char slot = conn->admissionWait;
+
+            if (admission_available(slot))
+            {
+                list_remove(e);
+                conn->admissionWait = 0;
+                admission_admit(conn, slot);
+                admitted = 1;
+                break;
+            }
+        }
+    } while (admitted);
+
+    dispatching = 0;
+}
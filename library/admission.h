@@ -0,0 +1,26 @@
+#ifndef INTERNAL_ADMISSION_H
+#define INTERNAL_ADMISSION_H
+
+/*
+ * Admission control for peer connections. When the grid comes back after an
+ * outage, all peers reconnect at once; limiting concurrent handshakes and
+ * pending MSG_CALL_REMOTE requests keeps the main loop responsive.
+ * Optionally the limits adapt (AIMD) to the grid's reply latency and errors.
+ * Everything here runs on the main loop thread.
+ */
+
+#define ADMIT_CALL      0x01 /* MSG_CALL_REMOTE sent, waiting for reply */
+#define ADMIT_HANDSHAKE 0x02 /* Tunnel handshake in progress */
+
+struct _osdg_connection;
+
+/* Returns nonzero if the slot is taken, zero if the connection has been queued */
+int admission_acquire(struct _osdg_connection *conn, unsigned char slot);
+void admission_release_slot(struct _osdg_connection *conn, unsigned char slot);
+/* Release everything, the connection is done */
+void admission_release(struct _osdg_connection *conn);
+void admission_run(void);
+/* MSG_CALL_REMOTE has been answered, feeds the adaptive limit */
+void admission_call_done(struct _osdg_connection *conn, int ok);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef INTERNAL_ATOMIC_WRAPPER_H
+#define INTERNAL_ATOMIC_WRAPPER_H
+
+/* GCC and clang builtins. Loads acquire, stores release, everything else is a full barrier */
+#define atomic_read(p)            __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define atomic_write(p, v)        __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define atomic_add(p, v)          __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST)
+#define atomic_sub(p, v)          __atomic_sub_fetch(p, v, __ATOMIC_SEQ_CST)
+#define atomic_or(p, v)           __atomic_fetch_or(p, v, __ATOMIC_SEQ_CST)
+#define atomic_xchg(p, v)         __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#define atomic_cas(p, old, new)   __atomic_compare_exchange_n(p, old, new, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define atomic_fence()            __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#endif
@@ -2,9 +2,17 @@
 #include <string.h>
 #include <time.h>
 
+#include "admission.h"
+#include "atomic_wrapper.h"
 #include "client.h"
+#include "completion.h"
+#include "handles.h"
 #include "logging.h"
 #include "mainloop.h"
+#include "pool.h"
+#include "probes.h"
+#include "profiling.h"
+#include "retry.h"
 #include "socket.h"
 
 void osdg_set_private_key(osdg_connection_t conn, const osdg_key_t private_key)
@@ -19,44 +27,25 @@ unsigned char *osdg_get_my_peer_id(osdg_connection_t conn)
   return conn->clientPubkey;
 }
 
-static inline void client_put_buffer_nolock(struct _osdg_connection *client, struct osdg_buffer *buffer)
-{
-    queue_put_nolock(&client->bufferQueue, &buffer->qe);
-}
-
-int connection_allocate_buffers(struct _osdg_connection *conn)
-{
-    int i;
-
-    if (conn->haveBuffers)
-        return 0;
-
-    for (i = 0; i < 3; i++)
-    {
-        void *buffer = malloc(conn->bufferSize);
-
-        if (!buffer)
-        {
-            conn->errorKind = osdg_memory_error;
-            return -1;
-        }
-
-        client_put_buffer_nolock(conn, buffer);
-    }
-
-    conn->haveBuffers = 1;
-    return 0;
-}
+static unsigned int lastConnId;
 
 osdg_connection_t osdg_connection_create(void)
 {
-  struct _osdg_connection *client = malloc(sizeof(struct _osdg_connection));
+  struct _osdg_connection *client = pool_get_connection(sizeof(struct _osdg_connection));
 
   if (!client)
     return NULL;
 
+  client->handle = handle_alloc(client);
+  if (!client->handle)
+  {
+    pool_put_connection(client);
+    return NULL;
+  }
+
   client->req.function  = NULL;
   client->uid           = -1;
+  client->connId        = atomic_add(&lastConnId, 1);
   client->sock          = -1;
   client->errorKind     = osdg_no_error;
   client->errorCode     = 0;
@@ -65,22 +54,32 @@ osdg_connection_t osdg_connection_create(void)
   client->changeState   = NULL;
   client->receiveData   = NULL;
   client->userData      = NULL;
+  client->freeData      = NULL;
   client->nonce         = 0;
   client->tunnelId      = NULL;
   client->closing       = 0;
-  client->haveBuffers   = 0;
-  /*
-   * This buffer size is used by original mdglib from DEVISmart Android APK,
-   * so we're using it as a default.
-   */
-  client->bufferSize    = 1536;
+  client->loopRef       = 0;
+  client->pipelineForward = 0;
+  client->priority      = 0;
+  client->admission     = 0;
+  client->admissionWait = 0;
+  client->cacheEntry.refs   = 0;
+  client->cacheEntry.cached = 0;
+  client->cacheEntry.users  = NULL;
+  client->forwardReq.next   = NULL;
+  client->waitReq.next      = NULL;
+  client->numFilters        = 0;
+  client->completionMode    = 0;
+  mainloop_timer_init(&client->retryTimer, NULL);
+  client->bufferSize    = DEFAULT_BUFFER_SIZE;
   client->receiveBuffer = NULL;
   client->pingInterval  = 0;
 
   list_init(&client->forwardList);
-  queue_init(&client->bufferQueue);
+  list_init(&client->waitList);
   event_init(&client->completion);
 
+  PROBE(conn_create, client->connId);
   return client;
 }
 
@@ -88,7 +87,7 @@ void connection_shutdown(struct _osdg_connection *client)
 {
     if (client->tunnelId)
     {
-        free(client->tunnelId);
+        client_put_buffer(client, client->tunnelId);
         client->tunnelId = NULL;
     }
 
@@ -105,17 +104,41 @@ void connection_shutdown(struct _osdg_connection *client)
     }
 }
 
-void connection_terminate(struct _osdg_connection *conn, enum osdg_connection_state state)
+static void connection_dump_flight_recorder(struct _osdg_connection *conn)
 {
-    struct list_element *req, *next;
+    struct flight_recorder *fr = &conn->flightRecorder;
+    unsigned int i = fr->count > FLIGHT_RECORDER_SIZE ? fr->count - FLIGHT_RECORDER_SIZE : 0;
+    timestamp_t now = timestamp();
 
-    mainloop_remove_connection(conn);
-    connection_shutdown(conn);
+    if (!fr->count)
+        return;
 
-    /* Terminate also peers, waiting for forwarding reply */
-    for (req = conn->forwardList.head; req->next; req = next)
+    LOG(ERRORS, "Conn[%p] last %u packets:", conn, fr->count - i);
+
+    for (; i < fr->count; i++)
     {
-        struct _osdg_connection *peer = get_connection(req);
+        const struct flight_record *r = &fr->rec[i & (FLIGHT_RECORDER_SIZE - 1)];
+        const char *dir = r->direction == FLIGHT_TX ? "TX" : "RX";
+
+        if (r->command < 256)
+        {
+            LOG(ERRORS, "  -%6llu ms %s forward msg %-3u size %u", now - r->time, dir, r->command, r->size);
+        }
+        else
+        {
+            LOG(ERRORS, "  -%6llu ms %s %.4s            size %u", now - r->time, dir, (const char *)&r->command, r->size);
+        }
+    }
+}
+
+static void connection_terminate_peers(struct _osdg_connection *conn, struct list *peers,
+                                       size_t offset, enum osdg_connection_state state)
+{
+    struct list_element *req, *next;
+
+    for (req = peers->head; req->next; req = next)
+    {
+        struct _osdg_connection *peer = (struct _osdg_connection *)((char *)req - offset);
 
         /* User's callback can even destroy the connection, so remember next pointer early */
         next = req->next;
@@ -129,8 +152,60 @@ void connection_terminate(struct _osdg_connection *conn, enum osdg_connection_st
         connection_terminate(peer, state);
     }
 
-    list_init(&conn->forwardList);
+    list_init(peers);
+}
+
+void connection_hold(struct _osdg_connection *conn)
+{
+    if (!conn->loopRef)
+    {
+        conn->loopRef = 1;
+        handle_get(conn->handle);
+    }
+}
+
+/* May free the connection if the user has already destroyed it */
+void connection_drop(struct _osdg_connection *conn)
+{
+    if (conn->loopRef)
+    {
+        conn->loopRef = 0;
+        osdg_handle_release(conn);
+    }
+}
+
+void connection_terminate(struct _osdg_connection *conn, enum osdg_connection_state state)
+{
+    int held;
+
+    mainloop_timer_stop(&conn->retryTimer);
+
+    /* Transient peer errors may be retried according to the policy */
+    if (state == osdg_error && conn->mode == mode_peer && !conn->closing && connection_retry(conn))
+        return;
+
+    /* The callback may start the connection over, which takes a new reference */
+    held = conn->loopRef;
+    conn->loopRef = 0;
+
+    PROBE(conn_terminate, conn->connId, state, conn->errorKind);
+    mainloop_remove_connection(conn);
+    connection_shutdown(conn);
+
+    if (conn->waitReq.next)
+        list_remove(&conn->waitReq);
+
+    if (state == osdg_error)
+        connection_dump_flight_recorder(conn);
+
+    /* Terminate also peers, waiting for forwarding reply or yet to send the call */
+    connection_terminate_peers(conn, &conn->forwardList, offsetof(struct _osdg_connection, forwardReq), state);
+    connection_terminate_peers(conn, &conn->waitList, offsetof(struct _osdg_connection, waitReq), state);
+
     connection_set_status(conn, state);
+
+    if (held)
+        osdg_handle_release(conn);
 }
 
 static int connection_close(struct _osdg_connection *conn)
@@ -155,17 +230,26 @@ osdg_result_t osdg_connection_close(osdg_connection_t conn)
 
 void osdg_connection_destroy(osdg_connection_t client)
 {
-  struct queue_element *buffer, *next;
+  /* Nobody is going to close it any more; the main loop keeps it until it's done */
+  if (connection_in_use(client))
+    osdg_connection_close(client);
 
-  for (buffer = client->bufferQueue.head; buffer; buffer = next)
-  {
-    next = buffer->next;
-    free(buffer);
-  }
+  /* Actually freed when the last handle user lets it go */
+  handle_put(client->handle);
+}
+
+void connection_free(struct _osdg_connection *client)
+{
+  if (client->freeData)
+    client->freeData(client->userData);
 
-  queue_destroy(&client->bufferQueue);
   event_destroy(&client->completion);
-  free(client);
+  pool_put_connection(client);
+}
+
+unsigned int osdg_get_connection_id(osdg_connection_t conn)
+{
+  return conn->connId;
 }
 
 osdg_result_t osdg_get_last_result(osdg_connection_t client)
@@ -237,12 +321,37 @@ void *osdg_get_user_data(osdg_connection_t conn) {
     return conn->userData;
 }
 
+void osdg_set_free_callback(osdg_connection_t conn, osdg_free_cb_t f) {
+    conn->freeData = f;
+}
+
 void connection_set_status(struct _osdg_connection *conn, enum osdg_connection_state state) {
     enum osdg_connection_state oldState = conn->state;
 
     conn->state = state;
-    if (conn->changeState)
+    mainloop_snapshot_dirty = 1;
+
+    /* Whatever happened, the handshake is over */
+    if (conn->admission || conn->admissionWait)
+        admission_release(conn);
+
+    if (conn->cacheEntry.cached && (state == osdg_closed || state == osdg_error))
+        tunnel_cache_connection_died(conn);
+
+    if (conn->completionMode)
+    {
+        completion_post_state(conn, state);
+    }
+    /* Our own reference keeps it alive during the callback; fails if already destroyed */
+    else if (conn->changeState && osdg_handle_acquire(conn->handle))
+    {
+        PROF_START(t);
+        PROBE(callback_entry, conn->connId, PROBE_CB_STATE);
         conn->changeState(conn, state);
+        PROBE(callback_return, conn->connId, PROBE_CB_STATE);
+        PROF_END(callback, t);
+        osdg_handle_release(conn);
+    }
 }
 
 int connection_set_result(struct _osdg_connection *conn, osdg_result_t result) {
@@ -258,29 +367,70 @@ int connection_set_result(struct _osdg_connection *conn, osdg_result_t result) {
 	}
 }
 
-void *client_get_buffer(struct _osdg_connection *client) {
-  struct osdg_buffer *buffer = queue_get(&client->bufferQueue);
-
-  if (! buffer) {
-    buffer = malloc(client->bufferSize);
-  }
-
-  return buffer;
-}
-
 void connection_read_data(struct _osdg_connection *conn) {
     int ret;
 
-    if (! conn->receiveBuffer) {
-        conn->receiveBuffer = client_get_buffer(conn);
-        conn->bytesLeft = 0;
-    }
+    /* Callbacks may destroy it, and handlers may terminate it, under receive_packet()'s feet */
+    handle_get(conn->handle);
 
     ret = receive_packet(conn);
     if (ret) {
-        LOG(ERRORS, "Conn[%p] died: %s system code %d", conn, osdg_get_result_str(conn->errorKind), conn->errorCode);
+        LOG_EVENT(ERRORS, LOG_EV_CONNECTION_DIED, conn->connId, conn->errorKind, conn->errorCode, 0);
         connection_terminate(conn, osdg_error);
     }
+
+    osdg_handle_release(conn);
+}
+
+osdg_result_t osdg_add_receive_filter(osdg_connection_t conn, const struct osdg_receive_filter *filter)
+{
+    unsigned int n = conn->numFilters;
+
+    if (filter->length > OSDG_FILTER_MAX_LENGTH || (!filter->length && !filter->size))
+        return osdg_invalid_parameters;
+    /* Nothing beyond a packet could ever match */
+    if (filter->offset > conn->bufferSize || filter->length > conn->bufferSize - filter->offset)
+        return osdg_invalid_parameters;
+    if (n == OSDG_MAX_FILTERS)
+        return osdg_memory_error; /* No room left */
+
+    conn->filters[n] = *filter;
+    /* Publish the count only after the filter is complete */
+    atomic_write(&conn->numFilters, n + 1);
+    return osdg_no_error;
+}
+
+void osdg_clear_receive_filters(osdg_connection_t conn)
+{
+    atomic_write(&conn->numFilters, 0);
+}
+
+static int connection_filter_data(struct _osdg_connection *conn, const unsigned char *data, unsigned int length)
+{
+    unsigned int n = atomic_read(&conn->numFilters);
+    unsigned int f, i;
+
+    for (f = 0; f < n; f++)
+    {
+        const struct osdg_receive_filter *filter = &conn->filters[f];
+        const unsigned char *p;
+
+        if ((filter->size && length != filter->size) ||
+            filter->length > length || filter->offset > length - filter->length)
+            continue;
+
+        p = data + filter->offset;
+        for (i = 0; i < filter->length; i++)
+        {
+            if ((p[i] ^ filter->value[i]) & filter->mask[i])
+                break;
+        }
+
+        if (i == filter->length)
+            return 1;
+    }
+
+    return 0;
 }
 
 int connection_handle_data(struct _osdg_connection *conn, const unsigned char *data, unsigned int length) {
@@ -293,5 +443,31 @@ int connection_handle_data(struct _osdg_connection *conn, const unsigned char *d
     data   += discard;
     length -= discard;
 
+    /* Grid and pairing connections have internal handlers, which are not callbacks */
+    if (conn->mode == mode_peer)
+    {
+        /* Dropped right here, not worth even a function call */
+        if (connection_filter_data(conn, data, length))
+            return 0;
+
+        /* Dropped if the ring is full, just like a socket buffer overflow */
+        if (conn->completionMode)
+        {
+            completion_post_data(conn, data, length);
+            return 0;
+        }
+
+        if (!conn->receiveData || !osdg_handle_acquire(conn->handle))
+            return 0;
+
+        PROF_START(t);
+        PROBE(callback_entry, conn->connId, PROBE_CB_DATA);
+        int ret = conn->receiveData(conn, data, length);
+        PROBE(callback_return, conn->connId, PROBE_CB_DATA);
+        PROF_END(callback, t);
+        osdg_handle_release(conn);
+        return ret;
+    }
+
     return conn->receiveData ? conn->receiveData(conn, data, length) : 0;
 }
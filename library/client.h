@@ -3,16 +3,14 @@
 
 #include <errno.h>
 #include "events_wrapper.h"
+#include "flight_recorder.h"
+#include "tunnel_cache.h"
 
 #include "opensdg.h"
 #include "tunnel_protocol.h"
 #include "control_protocol.pb-c.h"
 #include "mainloop.h"
-
-struct osdg_buffer
-{
-    struct queue_element qe;
-};
+#include "pool.h"
 
 enum connection_mode
 {
@@ -27,7 +25,11 @@ struct _osdg_connection
 {
   struct client_req          req;
   struct list_element        forwardReq;
+  struct list_element        admissionReq;      /* In admission queue while waiting */
+  struct list_element        waitReq;           /* In grid's waitList until MSG_CALL_REMOTE is sent */
   int                        uid;
+  unsigned int               connId;            /* Unique, for logging */
+  osdg_handle_t              handle;
   SOCKET                     sock;
   osdg_result_t              errorKind;
   unsigned int               errorCode;
@@ -36,6 +38,7 @@ struct _osdg_connection
   osdg_state_cb_t            changeState;
   osdg_receive_cb_t          receiveData;
   void                      *userData;
+  osdg_free_cb_t             freeData;
   unsigned char              clientPubkey[crypto_box_PUBLICKEYBYTES];     /* Client's public key */
   unsigned char              clientSecret[crypto_box_SECRETKEYBYTES];     /* Client's private key */
   unsigned char              serverPubkey[crypto_box_PUBLICKEYBYTES];     /* Server's public key */
@@ -48,14 +51,17 @@ struct _osdg_connection
   size_t                     tunnelIdSize;
   osdg_connection_t          grid;
   struct list                forwardList;
+  struct list                waitList;          /* Peers, not sent MSG_CALL_REMOTE yet */
   char                       protocol[SDG_MAX_PROTOCOL_BYTES];
   unsigned char              pairingResult[32];
   event_t                    completion;
   char                       closing;
-  char                       haveBuffers;
+  char                       loopRef;           /* The main loop holds a handle reference while running */
+  char                       pipelineForward;   /* Send TELL right after MSG_FORWARD_REMOTE */
+  char                       forwardPending;    /* MSG_FORWARD_REPLY not received yet */
   size_t                     bufferSize;
-  struct queue               bufferQueue;
-  unsigned char             *receiveBuffer;			// incoming packet buffer; bytes 0,1 are data size (big-endian)
+  unsigned char              sizePrefix[2];     /* Length of incoming packet, staged until a buffer is taken */
+  unsigned char             *receiveBuffer;			// incoming packet buffer, only held while a packet is in flight; bytes 0,1 are data size (big-endian)
   unsigned int               bytesReceived;			// number of received packet bytes in receiveBuffer
   unsigned int               bytesLeft;				// number of packet bytes still to be received
   unsigned int               discardFirstBytes;
@@ -63,30 +69,52 @@ struct _osdg_connection
   unsigned int               pingInterval;      /* In milliseconds */
   unsigned int               pingDelay;         /* Last PING roundtrip time */
   unsigned long long         lastPing;          /* When the last PING has been sent */
+  timestamp_t                startTime;         /* When the connection has been started */
+  struct flight_recorder     flightRecorder;    /* Last packets, for post-mortem */
+  int                        priority;          /* Admission order, higher goes first */
+  unsigned char              admission;         /* ADMIT_* slots held */
+  unsigned char              admissionWait;     /* ADMIT_* slot waited for, 0 if not queued */
+  timestamp_t                callStart;         /* When MSG_CALL_REMOTE has been sent */
+  unsigned short             pendingPort;       /* Forwarder to connect to, once admitted */
+  char                       pendingHost[256];
+  struct tunnel_cache_entry  cacheEntry;
+  unsigned char              completionMode;    /* Events go to the completion ring, not callbacks */
+  unsigned int               numFilters;        /* Receive filters in use */
+  struct osdg_receive_filter filters[OSDG_MAX_FILTERS];
+  unsigned int               retryCount;        /* Retries done by the retry policy */
+  struct mainloop_timer      retryTimer;
 };
 
-int connection_allocate_buffers(struct _osdg_connection *conn);
-void *client_get_buffer(struct _osdg_connection *conn);
+/* Packet buffers are shared by all connections, an idle connection holds none */
+static inline void *client_get_buffer(struct _osdg_connection *client)
+{
+    return pool_get_buffer(client->bufferSize);
+}
 
 static inline void client_put_buffer(struct _osdg_connection *client, void *ptr)
 {
-    queue_put(&client->bufferQueue, ptr);
+    pool_put_buffer(ptr, client->bufferSize);
 }
 
+void connection_hold(struct _osdg_connection *conn);
+void connection_drop(struct _osdg_connection *conn);
+
 static inline int connection_init(struct _osdg_connection *conn)
 {
-    int ret = connection_allocate_buffers(conn);
-
-    if (ret)
-        return ret;
-
+    conn->bytesLeft         = 0;
     conn->discardFirstBytes = 0;
+    conn->forwardPending    = 0;
     conn->state             = osdg_connecting;
     conn->pingSequence      = 0;
     conn->pingDelay         = -1;
     /* This causes mainloop_ping() to ignore the connection until
        the very first PING has been sent manually */
     conn->lastPing          = -1LL;
+    conn->startTime         = timestamp();
+    conn->retryCount        = 0;
+    conn->flightRecorder.count = 0;
+    /* Sockets, grid lists, admission queue and retry timer may refer to it from now on */
+    connection_hold(conn);
 
     return 0;
 }
@@ -106,6 +134,11 @@ void connection_set_status(struct _osdg_connection *conn, enum osdg_connection_s
 osdg_result_t connection_wait(struct _osdg_connection *conn);
 
 int peer_handle_remote_call_reply(struct _osdg_connection *peer, PeerReply *reply);
+int peer_send_call_remote(struct _osdg_connection *peer);
+int peer_connect_tunnel(struct _osdg_connection *peer);
+int peer_retry(struct _osdg_connection *peer);
+/* Keeps a peer, which is yet to send MSG_CALL_REMOTE, on its grid */
+void registry_wait(struct _osdg_connection *peer);
 
 static inline struct _osdg_connection *get_connection(struct list_element *forwardReq)
 {
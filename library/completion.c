@@ -0,0 +1,168 @@
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "atomic_wrapper.h"
+#include "client.h"
+#include "completion.h"
+#include "logging.h"
+#include "pool.h"
+
+static struct osdg_event ring[COMPLETION_RING_SIZE];
+static unsigned int      head;      /* Next to reap, advanced by consumers */
+static unsigned int      tail;      /* Next to post, advanced by the main loop */
+static unsigned int      overflows;
+static unsigned int      heldBuffers; /* By data events, not released yet */
+static int               posted;    /* Since the last wakeup */
+static int               wakeFd = -1;
+
+int completion_init(void)
+{
+    wakeFd = eventfd(0, EFD_NONBLOCK);
+    if (wakeFd == -1)
+    {
+        LOG(ERRORS, "Failed to create completion eventfd");
+        return -1;
+    }
+
+    head = tail = 0;
+    return 0;
+}
+
+void completion_shutdown(void)
+{
+    if (wakeFd != -1)
+    {
+        close(wakeFd);
+        wakeFd = -1;
+    }
+}
+
+static struct osdg_event *completion_reserve(struct _osdg_connection *conn)
+{
+    if (tail - atomic_read(&head) == COMPLETION_RING_SIZE)
+    {
+        atomic_add(&overflows, 1);
+        LOG_RATELIMITED(ERRORS, "Conn[%u] completion ring full, event dropped", conn->connId);
+        return NULL;
+    }
+
+    return &ring[tail & (COMPLETION_RING_SIZE - 1)];
+}
+
+static inline void completion_commit(void)
+{
+    atomic_write(&tail, tail + 1);
+    posted = 1;
+}
+
+void completion_flush(void)
+{
+    unsigned long long one = 1;
+
+    if (!posted)
+        return;
+
+    /* One wakeup per main loop iteration, however many events were posted */
+    posted = 0;
+    if (write(wakeFd, &one, sizeof(one)) < 0)
+        LOG(ERRORS, "Completion eventfd write failed");
+}
+
+void completion_post_state(struct _osdg_connection *conn, enum osdg_connection_state state)
+{
+    struct osdg_event *ev = completion_reserve(conn);
+
+    if (!ev)
+        return;
+
+    ev->handle     = conn->handle;
+    ev->type       = osdg_event_state;
+    ev->state      = state;
+    ev->data       = NULL;
+    ev->length     = 0;
+    ev->buffer     = NULL;
+    ev->bufferSize = 0;
+    completion_commit();
+}
+
+int completion_post_data(struct _osdg_connection *conn, const unsigned char *data, unsigned int length)
+{
+    struct osdg_event *ev;
+
+    /* Running out of buffers would kill connections, drop the data instead */
+    if (atomic_read(&heldBuffers) >= COMPLETION_MAX_BUFFERS)
+    {
+        atomic_add(&overflows, 1);
+        LOG_RATELIMITED(ERRORS, "Conn[%u] too many unreleased data events, data dropped", conn->connId);
+        return -1;
+    }
+
+    ev = completion_reserve(conn);
+    if (!ev)
+        return -1;
+
+    atomic_add(&heldBuffers, 1);
+    ev->handle     = conn->handle;
+    ev->type       = osdg_event_data;
+    ev->state      = conn->state;
+    ev->data       = data;
+    ev->length     = length;
+    /* The data lives in the receive buffer, hand it over instead of copying */
+    ev->buffer     = conn->receiveBuffer;
+    ev->bufferSize = (unsigned int)conn->bufferSize;
+    conn->receiveBuffer = NULL;
+    completion_commit();
+    return 0;
+}
+
+void osdg_set_completion_mode(osdg_connection_t conn, int enable)
+{
+    conn->completionMode = !!enable;
+}
+
+int osdg_get_completion_fd(void)
+{
+    return wakeFd;
+}
+
+unsigned int osdg_reap_events(struct osdg_event *events, unsigned int max)
+{
+    unsigned int h = atomic_read(&head);
+    unsigned int n, i;
+    unsigned long long count;
+
+    /* Reset the wakeup; anything posted after this will set it again */
+    if (read(wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        LOG(ERRORS, "Completion eventfd read failed");
+
+    do
+    {
+        n = atomic_read(&tail) - h;
+        if (n > max)
+            n = max;
+
+        /* Slots can't be reused before head moves, so copying first is safe */
+        for (i = 0; i < n; i++)
+            events[i] = ring[(h + i) & (COMPLETION_RING_SIZE - 1)];
+
+        /* Another consumer could have taken them, try again */
+    } while (n && !atomic_cas(&head, &h, h + n));
+
+    return n;
+}
+
+void osdg_event_release(struct osdg_event *event)
+{
+    if (event->buffer)
+    {
+        pool_put_buffer(event->buffer, event->bufferSize);
+        event->buffer = NULL;
+        atomic_sub(&heldBuffers, 1);
+    }
+}
+
+unsigned int osdg_get_completion_overflows(void)
+{
+    return atomic_read(&overflows);
+}
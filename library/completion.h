@@ -0,0 +1,33 @@
+#ifndef INTERNAL_COMPLETION_H
+#define INTERNAL_COMPLETION_H
+
+#include "opensdg.h"
+#include "pool.h"
+
+/*
+ * Completion ring. The main loop thread is the only producer; consumers may be
+ * many, on any threads.
+ */
+#define COMPLETION_RING_SIZE 1024 /* Must be a power of 2 */
+
+/*
+ * Every data event holds a packet buffer until released. Static pools are small,
+ * leave enough of them for connections to keep receiving and sending.
+ */
+#ifdef OSDG_STATIC_POOLS
+#define COMPLETION_MAX_BUFFERS (OSDG_POOL_BUFFERS / 2)
+#else
+#define COMPLETION_MAX_BUFFERS COMPLETION_RING_SIZE
+#endif
+
+struct _osdg_connection;
+
+int completion_init(void);
+void completion_shutdown(void);
+void completion_post_state(struct _osdg_connection *conn, enum osdg_connection_state state);
+/* Takes over the receive buffer on success; returns -1 if the ring or the buffer limit is full */
+int completion_post_data(struct _osdg_connection *conn, const unsigned char *data, unsigned int length);
+/* Wakes up consumers if anything has been posted; called by the main loop before sleeping */
+void completion_flush(void);
+
+#endif
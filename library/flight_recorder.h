@@ -0,0 +1,43 @@
+#ifndef INTERNAL_FLIGHT_RECORDER_H
+#define INTERNAL_FLIGHT_RECORDER_H
+
+#include "utils.h"
+
+/*
+ * Last packets, seen on a connection. This is always on and is dumped when
+ * the connection dies, so it has to stay cheap: no payload, no formatting.
+ * Size must be a power of 2.
+ */
+#define FLIGHT_RECORDER_SIZE 16
+
+#define FLIGHT_RX 0
+#define FLIGHT_TX 1
+
+struct flight_record
+{
+    timestamp_t    time;
+    unsigned int   command;   /* CurveCP command, or forwarder message type if < 256 */
+    unsigned short size;      /* Full packet size, including length prefix */
+    unsigned char  direction; /* FLIGHT_RX or FLIGHT_TX */
+};
+
+struct flight_recorder
+{
+    unsigned int         count; /* Total number of records made */
+    struct flight_record rec[FLIGHT_RECORDER_SIZE];
+};
+
+/* Packets can be sent from any thread, so this may lose a record in rare
+   cases. We don't care, it's diagnostics only. */
+static inline void flight_record(struct flight_recorder *fr, unsigned char direction,
+                                 unsigned int command, unsigned int size)
+{
+    struct flight_record *r = &fr->rec[fr->count++ & (FLIGHT_RECORDER_SIZE - 1)];
+
+    r->time      = timestamp();
+    r->command   = command;
+    r->size      = size;
+    r->direction = direction;
+}
+
+#endif
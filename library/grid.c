@@ -1,6 +1,8 @@
 #include "client.h"
 #include "control_protocol.h"
 #include "mainloop.h"
+#include "pool.h"
+#include "profiling.h"
 #include "socket.h"
 
 static osdg_result_t grid_handle_incoming_packet(struct _osdg_connection *conn,
@@ -25,7 +27,9 @@ static osdg_result_t grid_handle_incoming_packet(struct _osdg_connection *conn,
 
     if (msgType == MSG_PROTOCOL_VERSION)
     {
-        ProtocolVersion *protocolVer = protocol_version__unpack(NULL, length, data);
+        PROF_START(t);
+        ProtocolVersion *protocolVer = protocol_version__unpack(PB_ALLOCATOR, length, data);
+        PROF_END(unpack, t);
 
         if (!protocolVer)
         {
@@ -49,7 +53,7 @@ static osdg_result_t grid_handle_incoming_packet(struct _osdg_connection *conn,
             /* We're done with the handshake */
         }
 
-        protocol_version__free_unpacked(protocolVer, NULL);
+        protocol_version__free_unpacked(protocolVer, PB_ALLOCATOR);
 
         /* Send the very first ping right after the connection has been established.
            This is what the original library does. */
@@ -58,7 +62,9 @@ static osdg_result_t grid_handle_incoming_packet(struct _osdg_connection *conn,
     }
     else if (msgType == MSG_PONG)
     {
-        Pong *reply = pong__unpack(NULL, length, data);
+        PROF_START(t);
+        Pong *reply = pong__unpack(PB_ALLOCATOR, length, data);
+        PROF_END(unpack, t);
 
         if (!reply)
         {
@@ -70,10 +76,11 @@ static osdg_result_t grid_handle_incoming_packet(struct _osdg_connection *conn,
         if (reply->seq == conn->pingSequence - 1)
         {
             conn->pingDelay = (int)(timestamp() - conn->lastPing);
+            mainloop_snapshot_dirty = 1;
             LOG(PROTOCOL, "Grid[%p] %-10s roundtrip %ld ms", conn, "PING", conn->pingDelay);
         }
 
-        pong__free_unpacked(reply, NULL);
+        pong__free_unpacked(reply, PB_ALLOCATOR);
 
         /* This is reply to the very first PING, we are connected now. */
         if (conn->state == osdg_connecting)
@@ -84,8 +91,10 @@ static osdg_result_t grid_handle_incoming_packet(struct _osdg_connection *conn,
     }
     else if ((msgType == MSG_REMOTE_REPLY) || (msgType == MSG_PAIR_REMOTE_REPLY))
     {
-        PeerReply *reply = peer_reply__unpack(NULL, length, data);
+        PROF_START(t);
+        PeerReply *reply = peer_reply__unpack(PB_ALLOCATOR, length, data);
         struct list_element *req;
+        PROF_END(unpack, t);
 
         if (!reply)
         {
@@ -101,19 +110,21 @@ static osdg_result_t grid_handle_incoming_packet(struct _osdg_connection *conn,
             {
                 list_remove(req);
                 ret = peer_handle_remote_call_reply(peer, reply);
-                peer_reply__free_unpacked(reply, NULL);
+                peer_reply__free_unpacked(reply, PB_ALLOCATOR);
                 return ret;
             }
         }
 
-        LOG(ERRORS, "Received MSG_PEER_REPLY for nonexistent peer %u\n", reply->id);
-        peer_reply__free_unpacked(reply, NULL);
+        LOG_RATELIMITED(ERRORS, "Received MSG_PEER_REPLY for nonexistent peer %u", reply->id);
+        peer_reply__free_unpacked(reply, PB_ALLOCATOR);
         /* Ignore, this is not critical */
     }
     else if (msgType == MSG_INCOMING_CALL)
     {
-        IncomingCall *call = incoming_call__unpack(NULL, length, data);
+        PROF_START(t);
+        IncomingCall *call = incoming_call__unpack(PB_ALLOCATOR, length, data);
         IncomingCallReply reply = INCOMING_CALL_REPLY__INIT;
+        PROF_END(unpack, t);
 
         if (!call)
         {
@@ -127,12 +138,12 @@ static osdg_result_t grid_handle_incoming_packet(struct _osdg_connection *conn,
         reply.id = call->id;
         reply.result = 0;
 
-        incoming_call__free_unpacked(call, NULL);
+        incoming_call__free_unpacked(call, PB_ALLOCATOR);
         ret = sendMESG(conn, MSG_INCOMING_CALL_REPLY, &reply);
     }
     else
     {
-        DUMP(PROTOCOL, data, length, "Unhandled grid message type %u", msgType);
+        DUMP_RATELIMITED(PROTOCOL, data, length, "Unhandled grid message type %u", msgType);
     }
 
     return ret;
@@ -191,6 +202,7 @@ osdg_result_t osdg_connect_to_grid(osdg_connection_t client,
 
         client->errorKind = osdg_memory_error;
         client->state = osdg_error;
+        connection_drop(client);
         return osdg_connection_failed;
     }
 
@@ -227,6 +239,7 @@ osdg_result_t osdg_connect_to_grid(osdg_connection_t client,
     if (res < 0)
     {
         client->state = osdg_error;
+        connection_drop(client);
         return osdg_connection_failed;
     }
 
@@ -0,0 +1,135 @@
+#include "atomic_wrapper.h"
+#include "client.h"
+#include "handles.h"
+#include "logging.h"
+#include "pthread_wrapper.h"
+
+#define HANDLE_INDEX(h) ((unsigned int)(h))
+#define HANDLE_GEN(h)   ((unsigned int)((h) >> 32))
+#define MAKE_HANDLE(gen, idx) (((osdg_handle_t)(gen) << 32) | (idx))
+
+struct handle_slot
+{
+    /* Generation in high 32 bits, reference count in low ones; changed atomically as a whole */
+    unsigned long long       state;
+    struct _osdg_connection *conn;
+    unsigned int             nextFree;
+};
+
+static struct handle_slot handles[MAX_HANDLES];
+
+/* Only allocation and freeing lock, lookup is lock-free */
+static pthread_mutex_t handleLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int    firstFree = MAX_HANDLES;
+static unsigned int    highWater;
+
+osdg_handle_t handle_alloc(struct _osdg_connection *conn)
+{
+    struct handle_slot *s;
+    unsigned int idx, gen;
+
+    pthread_mutex_lock(&handleLock);
+
+    if (firstFree != MAX_HANDLES)
+    {
+        idx = firstFree;
+        firstFree = handles[idx].nextFree;
+    }
+    else if (highWater < MAX_HANDLES)
+    {
+        idx = highWater++;
+    }
+    else
+    {
+        pthread_mutex_unlock(&handleLock);
+        LOG(ERRORS, "Handle table of %u exhausted", MAX_HANDLES);
+        return 0;
+    }
+
+    pthread_mutex_unlock(&handleLock);
+
+    s = &handles[idx];
+    /* Generation 0 is never used, so 0 is never a valid handle */
+    gen = HANDLE_GEN(s->state);
+    if (!gen)
+        gen = 1;
+
+    s->conn = conn;
+    atomic_write(&s->state, MAKE_HANDLE(gen, 1));
+
+    return MAKE_HANDLE(gen, idx);
+}
+
+static void handle_free(unsigned int idx)
+{
+    connection_free(handles[idx].conn);
+    handles[idx].conn = NULL;
+
+    pthread_mutex_lock(&handleLock);
+    handles[idx].nextFree = firstFree;
+    firstFree = idx;
+    pthread_mutex_unlock(&handleLock);
+}
+
+static void handle_unref(unsigned int idx)
+{
+    unsigned long long state = atomic_sub(&handles[idx].state, 1);
+
+    if (!(unsigned int)state)
+        handle_free(idx);
+}
+
+void handle_put(osdg_handle_t handle)
+{
+    struct handle_slot *s = &handles[HANDLE_INDEX(handle)];
+    unsigned long long state = atomic_read(&s->state);
+    unsigned int gen;
+
+    /* Bump the generation, so that nobody can acquire it any more, and drop our reference */
+    do
+    {
+        gen = HANDLE_GEN(state) + 1;
+        if (!gen)
+            gen = 1;
+    } while (!atomic_cas(&s->state, &state, MAKE_HANDLE(gen, (unsigned int)state - 1)));
+
+    if ((unsigned int)state == 1)
+        handle_free(HANDLE_INDEX(handle));
+}
+
+void handle_get(osdg_handle_t handle)
+{
+    atomic_add(&handles[HANDLE_INDEX(handle)].state, 1);
+}
+
+osdg_handle_t osdg_get_handle(osdg_connection_t conn)
+{
+    return conn->handle;
+}
+
+osdg_connection_t osdg_handle_acquire(osdg_handle_t handle)
+{
+    unsigned int idx = HANDLE_INDEX(handle);
+    struct handle_slot *s;
+    unsigned long long state;
+
+    if (idx >= MAX_HANDLES)
+        return NULL;
+
+    s = &handles[idx];
+    state = atomic_read(&s->state);
+
+    do
+    {
+        /* Stale, or already being freed */
+        if (HANDLE_GEN(state) != HANDLE_GEN(handle) || !(unsigned int)state)
+            return NULL;
+    } while (!atomic_cas(&s->state, &state, state + 1));
+
+    return s->conn;
+}
+
+void osdg_handle_release(osdg_connection_t conn)
+{
+    handle_unref(HANDLE_INDEX(conn->handle));
+}
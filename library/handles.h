@@ -0,0 +1,26 @@
+#ifndef INTERNAL_HANDLES_H
+#define INTERNAL_HANDLES_H
+
+#include "opensdg.h"
+
+/*
+ * Generational handle table. A handle is slot index (low 32 bits) and slot
+ * generation (high 32 bits). The connection itself holds one reference, dropped
+ * by osdg_connection_destroy(); the memory is freed when the last one goes.
+ * The main loop holds its own references while a connection is running and
+ * while a client request for it is queued.
+ */
+#ifndef OSDG_MAX_HANDLES
+#define OSDG_MAX_HANDLES 4096 /* MAX_HANDLES cmake option */
+#endif
+#define MAX_HANDLES OSDG_MAX_HANDLES
+
+osdg_handle_t handle_alloc(struct _osdg_connection *conn);
+void handle_put(osdg_handle_t handle);
+/* One more reference, regardless of generation; the caller must already hold one */
+void handle_get(osdg_handle_t handle);
+
+/* Frees the connection, called when the last reference is gone */
+void connection_free(struct _osdg_connection *conn);
+
+#endif
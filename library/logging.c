@@ -1,10 +1,13 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "logging.h"
 #include "opensdg.h"
+#include "utils.h"
 
 unsigned int log_mask = 0;
+osdg_log_record_cb_t log_record_cb = NULL;
 
 void _log(unsigned int mask, const char *format, ...)
 {
@@ -41,3 +44,149 @@ void osdg_set_log_mask(unsigned int mask)
 {
     log_mask = mask;
 }
+
+static unsigned int ratelimitInterval = 1000;
+static unsigned int ratelimitBurst    = 10;
+static unsigned int ratelimitSample   = 0;
+
+void osdg_set_log_rate_limit(unsigned int interval, unsigned int burst, unsigned int sample)
+{
+    ratelimitInterval = interval;
+    ratelimitBurst    = burst;
+    ratelimitSample   = sample;
+}
+
+/* Sampling doesn't need a good generator, but needs a fast one */
+static unsigned int sample_random(void)
+{
+    static unsigned int state = 2463534242U;
+
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+int osdg_log_ratelimit(struct osdg_log_ratelimit *rl)
+{
+    timestamp_t now = timestamp();
+    int suppressed;
+
+    if (now - rl->intervalStart >= ratelimitInterval)
+    {
+        rl->intervalStart = now;
+        rl->printed       = 0;
+    }
+
+    if (rl->printed >= ratelimitBurst &&
+        (ratelimitSample == 0 || sample_random() % ratelimitSample))
+    {
+        rl->suppressed++;
+        return -1;
+    }
+
+    rl->printed++;
+    suppressed = rl->suppressed;
+    rl->suppressed = 0;
+    return suppressed;
+}
+
+void _log_suppressed(unsigned int mask, int suppressed, const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    vprintf(format, ap);
+    va_end(ap);
+
+    if (suppressed)
+        printf(" (%d similar messages suppressed)", suppressed);
+
+    putchar('\n');
+}
+
+/* Formats take connection ID, followed by up to OSDG_LOG_MAX_ARGS strings */
+static const struct
+{
+    const char   *format;
+    unsigned char argTypes[OSDG_LOG_MAX_ARGS];
+} log_events[LOG_EV_MAX] =
+{
+    { "Conn[%u] Received   %s size %s",    { osdg_log_arg_fourcc, osdg_log_arg_uint } },
+    { "Conn[%u] Sending    %s size %s",    { osdg_log_arg_fourcc, osdg_log_arg_uint } },
+    { "Conn[%u] died: %s system code %s",  { osdg_log_arg_result, osdg_log_arg_uint } }
+};
+
+void _log_event(unsigned int mask, enum log_event event, unsigned int connId,
+                unsigned long long a0, unsigned long long a1, unsigned long long a2)
+{
+    struct osdg_log_record rec;
+
+    rec.timestamp = timestamp();
+    rec.event     = event;
+    rec.mask      = mask;
+    rec.connId    = connId;
+    rec.args[0]   = a0;
+    rec.args[1]   = a1;
+    rec.args[2]   = a2;
+    memcpy(rec.argTypes, log_events[event].argTypes, sizeof(rec.argTypes));
+
+    if (log_record_cb)
+    {
+        log_record_cb(&rec);
+    }
+    else
+    {
+        char buffer[256];
+
+        osdg_format_log_record(buffer, sizeof(buffer), &rec);
+        _log(mask, "%s", buffer);
+    }
+}
+
+void osdg_set_log_record_callback(osdg_log_record_cb_t f)
+{
+    log_record_cb = f;
+}
+
+static void format_log_arg(char *buffer, size_t len, unsigned char type, unsigned long long value)
+{
+    switch (type)
+    {
+    case osdg_log_arg_uint:
+        snprintf(buffer, len, "%llu", value);
+        break;
+    case osdg_log_arg_hex:
+        snprintf(buffer, len, "0x%llx", value);
+        break;
+    case osdg_log_arg_fourcc:
+        /* Packet commands are stored in wire byte order */
+        snprintf(buffer, len, "%c%c%c%c", (char)value, (char)(value >> 8), (char)(value >> 16), (char)(value >> 24));
+        break;
+    case osdg_log_arg_result:
+        snprintf(buffer, len, "%s", osdg_get_result_str((osdg_result_t)value));
+        break;
+    default:
+        buffer[0] = 0;
+        break;
+    }
+}
+
+size_t osdg_format_log_record(char *buffer, size_t len, const struct osdg_log_record *rec)
+{
+    char args[OSDG_LOG_MAX_ARGS][64];
+    unsigned int i;
+    int rl;
+
+    if (rec->event >= LOG_EV_MAX)
+    {
+        rl = snprintf(buffer, len, "Conn[%u] unknown event %u", rec->connId, rec->event);
+        return rl + 1;
+    }
+
+    for (i = 0; i < OSDG_LOG_MAX_ARGS; i++)
+        format_log_arg(args[i], sizeof(args[i]), rec->argTypes[i], rec->args[i]);
+
+    rl = snprintf(buffer, len, log_events[rec->event].format, rec->connId, args[0], args[1], args[2]);
+    return rl + 1;
+}
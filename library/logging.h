@@ -3,17 +3,68 @@
 
 #include "opensdg.h"
 
+/*
+ * Categories, which are not in OSDG_LOG_BUILD_MASK, are compiled out
+ * completely, including their arguments. See LOG_LEVEL cmake option.
+ */
+#ifndef OSDG_LOG_BUILD_MASK
+#define OSDG_LOG_BUILD_MASK (OSDG_LOG_ERRORS | OSDG_LOG_CONNECTION | OSDG_LOG_PROTOCOL | OSDG_LOG_PACKETS)
+#endif
+
 extern unsigned int log_mask;
+extern osdg_log_record_cb_t log_record_cb;
+
+#define LOG_ENABLED(mask) \
+  ((OSDG_LOG_BUILD_MASK & OSDG_LOG_ ## mask) && (log_mask & OSDG_LOG_ ## mask))
 
 #define LOG(mask, ...)              \
-  if (log_mask & OSDG_LOG_ ## mask) \
+  if (LOG_ENABLED(mask))            \
     _log(OSDG_LOG_ ## mask, __VA_ARGS__)
 
 #define DUMP(mask, data, size, ...) \
-  if (log_mask & OSDG_LOG_ ## mask) \
+  if (LOG_ENABLED(mask))            \
     _dump(OSDG_LOG_ ## mask, data, size, __VA_ARGS__)
 
+/* Like LOG() and DUMP(), but limited per call site, see osdg_set_log_rate_limit() */
+#define LOG_RATELIMITED(mask, ...)                                \
+  if (LOG_ENABLED(mask)) {                                        \
+    static struct osdg_log_ratelimit _rl;                         \
+    int _suppressed = osdg_log_ratelimit(&_rl);                   \
+    if (_suppressed >= 0)                                         \
+      _log_suppressed(OSDG_LOG_ ## mask, _suppressed, __VA_ARGS__); \
+  }
+
+#define DUMP_RATELIMITED(mask, data, size, ...)                   \
+  if (LOG_ENABLED(mask)) {                                        \
+    static struct osdg_log_ratelimit _rl;                         \
+    int _suppressed = osdg_log_ratelimit(&_rl);                   \
+    if (_suppressed >= 0)                                         \
+      _dump(OSDG_LOG_ ## mask, data, size, __VA_ARGS__);          \
+    if (_suppressed > 0)                                          \
+      _log(OSDG_LOG_ ## mask, "(%d similar messages suppressed)", _suppressed); \
+  }
+
+/*
+ * Structured events. These are passed to log_record_cb as binary records if
+ * it's set, otherwise formatted and printed like LOG() does.
+ * IDs are part of the ABI, add new ones only to the end.
+ */
+enum log_event
+{
+    LOG_EV_PACKET_RECEIVED,  /* command, payload size */
+    LOG_EV_PACKET_SENT,      /* command, payload size */
+    LOG_EV_CONNECTION_DIED,  /* result, system error code */
+    LOG_EV_MAX
+};
+
+#define LOG_EVENT(mask, event, connId, a0, a1, a2) \
+  if (LOG_ENABLED(mask))                           \
+    _log_event(OSDG_LOG_ ## mask, event, connId, a0, a1, a2)
+
 void _log(unsigned int mask, const char *format, ...);
 void _dump(unsigned int mask, const unsigned char *data, size_t len, const char *format, ...);
+void _log_suppressed(unsigned int mask, int suppressed, const char *format, ...);
+void _log_event(unsigned int mask, enum log_event event, unsigned int connId,
+                unsigned long long a0, unsigned long long a1, unsigned long long a2);
 
 #endif
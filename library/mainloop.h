@@ -3,6 +3,12 @@
 
 #include "utils.h"
 
+/*
+ * Could be a temporary solution, but anyways this is more than
+ * the original Trifork library can handle
+ */
+#define MAX_CONNECTIONS 256
+
 typedef int(*client_req_cb_t)(struct _osdg_connection *);
 
 struct client_req
@@ -11,6 +17,26 @@ struct client_req
     client_req_cb_t      function;
 };
 
+/* Fires on the main loop thread; may be started and stopped from any thread */
+struct mainloop_timer
+{
+    struct list_element le;
+    timestamp_t         when;
+    void              (*fn)(struct mainloop_timer *t);
+    char                armed;
+};
+
+static inline void mainloop_timer_init(struct mainloop_timer *t, void (*fn)(struct mainloop_timer *t))
+{
+    t->fn    = fn;
+    t->armed = 0;
+}
+
+void mainloop_timer_start(struct mainloop_timer *t, unsigned int delay);
+void mainloop_timer_stop(struct mainloop_timer *t);
+/* Fires expired timers, returns expiration time of the next one */
+timestamp_t mainloop_run_timers(void);
+
 void mainloop_events_init(void);
 void mainloop_events_shutdown(void);
 void mainloop_send_client_request(struct client_req *req, client_req_cb_t function);
@@ -24,6 +50,16 @@ void mainloop_remove_connection(struct _osdg_connection *conn);
 timestamp_t mainloop_ping(struct _osdg_connection** connList, unsigned int connCount);
 int mainloop_calc_timeout(timestamp_t nextPing);
 
+/* Set by the main loop thread whenever something, visible via osdg_enumerate_connections(), changes */
+extern int mainloop_snapshot_dirty;
+void mainloop_publish_snapshot(struct _osdg_connection **connList, unsigned int connCount);
+
+static inline void mainloop_update_snapshot(struct _osdg_connection **connList, unsigned int connCount)
+{
+    if (mainloop_snapshot_dirty)
+        mainloop_publish_snapshot(connList, connCount);
+}
+
 extern const struct osdg_main_loop_callbacks *main_cb;
 
 static inline void main_loop_start_cb(void)
@@ -1,4 +1,7 @@
+#include "admission.h"
+#include "atomic_wrapper.h"
 #include "client.h"
+#include "handles.h"
 #include "mainloop.h"
 #include "utils.h"
 
@@ -39,7 +42,11 @@ void mainloop_send_client_request(struct client_req *req, client_req_cb_t functi
     req->function = function;
 
     if (oldCb == NULL)
+    {
+        /* The queued request keeps the connection alive, even if it's destroyed right away */
+        handle_get(((struct _osdg_connection *)req)->handle);
         queue_put_nolock(&mainloop_requests, &req->qe);
+    }
 
     pthread_mutex_unlock(&mainloop_requests.lock);
 
@@ -74,6 +81,100 @@ void mainloop_handle_client_requests(void)
 
         if (res)
             connection_terminate(conn, osdg_error);
+
+        osdg_handle_release(conn);
+    }
+
+    /* Admission limits could have been raised */
+    admission_run();
+}
+
+/* Sorted by expiration time */
+static pthread_mutex_t timerLock = PTHREAD_MUTEX_INITIALIZER;
+static struct list timers =
+{
+    (struct list_element *)&timers.stop,
+    NULL,
+    (struct list_element *)&timers.head
+};
+
+static inline struct mainloop_timer *get_timer(struct list_element *e)
+{
+    return (struct mainloop_timer *)((char *)e - offsetof(struct mainloop_timer, le));
+}
+
+void mainloop_timer_start(struct mainloop_timer *t, unsigned int delay)
+{
+    struct list_element *e;
+    int first;
+
+    pthread_mutex_lock(&timerLock);
+
+    if (t->armed)
+        list_remove(&t->le);
+
+    t->when  = timestamp() + delay;
+    t->armed = 1;
+
+    for (e = timers.head; e->next; e = e->next)
+    {
+        if (get_timer(e)->when > t->when)
+            break;
+    }
+
+    list_insert_before(&t->le, e);
+    first = timers.head == &t->le;
+
+    pthread_mutex_unlock(&timerLock);
+
+    /* The main loop may need to wake up earlier than it planned */
+    if (first)
+        mainloop_client_event();
+}
+
+void mainloop_timer_stop(struct mainloop_timer *t)
+{
+    pthread_mutex_lock(&timerLock);
+
+    if (t->armed)
+    {
+        list_remove(&t->le);
+        t->armed = 0;
+    }
+
+    pthread_mutex_unlock(&timerLock);
+}
+
+timestamp_t mainloop_run_timers(void)
+{
+    for (;;)
+    {
+        struct mainloop_timer *t;
+
+        pthread_mutex_lock(&timerLock);
+
+        if (!timers.head->next)
+        {
+            pthread_mutex_unlock(&timerLock);
+            return TS_NEVER;
+        }
+
+        t = get_timer(timers.head);
+        if (t->when > timestamp())
+        {
+            timestamp_t next = t->when;
+
+            pthread_mutex_unlock(&timerLock);
+            return next;
+        }
+
+        list_remove(&t->le);
+        t->armed = 0;
+
+        pthread_mutex_unlock(&timerLock);
+
+        /* The callback is free to restart the timer */
+        t->fn(t);
     }
 }
 
@@ -128,4 +229,83 @@ int mainloop_calc_timeout(timestamp_t sleepUntil)
         timestamp_t now = timestamp();
         return sleepUntil > now ? (int)(sleepUntil - now) : 0;
     }
-}
\ No newline at end of file
+}
+
+/*
+ * Connection table snapshot for osdg_enumerate_connections(). There are two
+ * copies, readers are pointed to the most recent one. The main loop always
+ * writes the other one, so readers never wait and never make the loop wait.
+ * A reader, which has been overtaken by two updates in a row, notices changed
+ * sequence number and simply retries.
+ */
+struct connection_snapshot
+{
+    unsigned int                seq;   /* Odd while the copy is being written */
+    unsigned int                count;
+    struct osdg_connection_info conn[MAX_CONNECTIONS];
+};
+
+static struct connection_snapshot snapshot[2];
+static unsigned int snapshotIndex;
+int mainloop_snapshot_dirty;
+
+void mainloop_publish_snapshot(struct _osdg_connection **connList, unsigned int connCount)
+{
+    unsigned int idx = snapshotIndex ^ 1;
+    struct connection_snapshot *s = &snapshot[idx];
+    unsigned int i;
+
+    atomic_add(&s->seq, 1);
+
+    for (i = 0; i < connCount; i++)
+    {
+        struct _osdg_connection *conn = connList[i];
+        struct osdg_connection_info *info = &s->conn[i];
+        struct list_element *req;
+
+        info->conn       = conn;
+        info->mode       = (enum osdg_connection_mode)conn->mode;
+        info->state      = conn->state;
+        info->rtt        = conn->pingDelay;
+        info->queueDepth = 0;
+        /* Converted to the actual age by the reader */
+        info->age        = conn->startTime;
+        memcpy(info->peerId, conn->serverPubkey, sizeof(info->peerId));
+
+        for (req = conn->forwardList.head; req->next; req = req->next)
+            info->queueDepth++;
+    }
+
+    s->count = connCount;
+    atomic_add(&s->seq, 1);
+
+    atomic_write(&snapshotIndex, idx);
+    mainloop_snapshot_dirty = 0;
+}
+
+unsigned int osdg_enumerate_connections(struct osdg_connection_info *buffer, unsigned int count)
+{
+    struct connection_snapshot *s;
+    unsigned int seq, total, copied, i;
+    timestamp_t now;
+
+    do
+    {
+        s = &snapshot[atomic_read(&snapshotIndex)];
+        seq = atomic_read(&s->seq);
+        if (seq & 1)
+            continue;
+
+        total = s->count;
+        copied = count < total ? count : total;
+
+        memcpy(buffer, s->conn, copied * sizeof(struct osdg_connection_info));
+        atomic_fence();
+    } while (seq & 1 || atomic_read(&s->seq) != seq);
+
+    now = timestamp();
+    for (i = 0; i < copied; i++)
+        buffer[i].age = now - buffer[i].age;
+
+    return total;
+}
@@ -1,14 +1,17 @@
-/*
- * Could be a temporary solution, but anyways this is more than
- * the original Trifork library can handle
- */
-#define MAX_CONNECTIONS 256
-
+#define _GNU_SOURCE /* For pthread_attr_setaffinity_np() */
 #include <sys/eventfd.h>
 #include <poll.h>
+#include <sched.h>
+#include <string.h>
 
+#include "atomic_wrapper.h"
 #include "client.h"
+#include "completion.h"
+#include "events_wrapper.h"
+#include "logging.h"
 #include "mainloop.h"
+#include "pool.h"
+#include "probes.h"
 #include "socket.h"
 #include "utils.h"
 
@@ -17,14 +20,91 @@ static unsigned int num_connections = 0;
 static struct pollfd events[MAX_CONNECTIONS + 1];
 static pthread_t thread;
 static int stopFlag;
+static int running;
+static unsigned int busyPoll; /* Microseconds */
+static int spinning;          /* The loop is busy polling, eventfd is not needed */
+static int wakePending;       /* Wakeup, requested while spinning */
+
+static struct
+{
+    cpu_set_t    cpus;
+    int          pinned;
+    int          policy;
+    int          priority;
+    unsigned int localBuffers;
+} placement;
+static event_t threadReady;
+
+osdg_result_t osdg_set_thread_placement(const struct osdg_thread_placement *p)
+{
+    unsigned int i;
+
+    if (running)
+        return osdg_wrong_state;
+
+    memset(&placement, 0, sizeof(placement));
+    if (!p)
+        return osdg_no_error;
+
+    for (i = 0; i < p->numCpus; i++)
+    {
+        if (p->cpus[i] < 0 || p->cpus[i] >= CPU_SETSIZE)
+            return osdg_invalid_parameters;
+        CPU_SET(p->cpus[i], &placement.cpus);
+    }
+
+    placement.pinned       = p->numCpus != 0;
+    placement.policy       = p->policy;
+    placement.priority     = p->priority;
+    placement.localBuffers = p->localBuffers;
+
+    return osdg_no_error;
+}
 
 void mainloop_client_event(void)
 {
     static const unsigned long long v = 1;
 
+    /*
+     * A spinning loop will notice the wakeup by itself. Not every wakeup queues
+     * a request (timers, ping interval, admission limits), so it's flagged.
+     * The fence pairs with the one in mainloop_spin(): either we see the loop
+     * spinning, or the loop sees our flag after it stops.
+     */
+    atomic_write(&wakePending, 1);
+    atomic_fence();
+    if (atomic_read(&spinning))
+        return;
+
     write(events[0].fd, &v, sizeof(v));
 }
 
+void osdg_set_busy_poll(unsigned int usec)
+{
+    atomic_write(&busyPoll, usec);
+}
+
+/* Returns nonzero if the loop has been woken up while spinning; poll() result is in *r */
+static int mainloop_spin(unsigned int usec, int *r)
+{
+    timestamp_t deadline = timestamp_us() + usec;
+    int pending;
+
+    atomic_write(&spinning, 1);
+    atomic_fence();
+
+    do
+    {
+        *r = poll(events, num_connections + 1, 0);
+        pending = atomic_read(&wakePending) || atomic_read(&stopFlag);
+    } while (*r == 0 && !pending && timestamp_us() < deadline);
+
+    atomic_write(&spinning, 0);
+    atomic_fence();
+
+    return atomic_xchg(&wakePending, 0) || atomic_read(&stopFlag);
+}
+
 void mainloop_remove_connection(struct _osdg_connection *conn)
 {
     unsigned int i;
@@ -45,6 +125,8 @@ void mainloop_remove_connection(struct _osdg_connection *conn)
         connections[i] = connections[num_connections];
         events[i + 1] = events[num_connections + 1];
     }
+
+    mainloop_snapshot_dirty = 1;
 }
 
 int mainloop_add_connection(struct _osdg_connection *conn)
@@ -58,6 +140,18 @@ int mainloop_add_connection(struct _osdg_connection *conn)
     connections[num_connections++] = conn;
     events[num_connections].fd = conn->sock;
     events[num_connections].events = POLLIN;
+    mainloop_snapshot_dirty = 1;
+
+#ifdef SO_BUSY_POLL
+    if (busyPoll)
+    {
+        int usec = busyPoll;
+
+        /* Values above net.core.busy_read sysctl need CAP_NET_ADMIN, not fatal */
+        if (setsockopt(conn->sock, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)))
+            LOG(CONNECTION, "Conn[%u] Failed to set SO_BUSY_POLL, error %d", conn->connId, errno);
+    }
+#endif
 
     return 0;
 }
@@ -66,12 +160,44 @@ static void *osdg_main(void *arg)
 {
     timestamp_t nextPing = TS_NEVER;
 
+    /* Failure is not fatal, buffers will simply come from the heap */
+    if (placement.localBuffers && pool_allocate_local_buffers(placement.localBuffers))
+        LOG(ERRORS, "Failed to preallocate %u local buffers", placement.localBuffers);
+    event_post(&threadReady);
+
     main_loop_start_cb();
 
     for (;;)
     {
-        int timeout = mainloop_calc_timeout(nextPing);
-        int r = poll(events, num_connections + 1, timeout);
+        unsigned int spin = atomic_read(&busyPoll);
+        timestamp_t nextTimer = mainloop_run_timers();
+        int timeout;
+        int r = 0;
+
+        completion_flush();
+
+        if (spin && mainloop_spin(spin, &r))
+        {
+            /* Wakeups while spinning didn't signal the eventfd */
+            mainloop_handle_client_requests();
+            nextPing = mainloop_ping(connections, num_connections);
+
+            if (stopFlag)
+                break;
+
+            /* Timers could have been started, recompute before sleeping */
+            if (r == 0)
+                continue;
+        }
+
+        if (r == 0)
+        {
+            timeout = mainloop_calc_timeout(nextPing < nextTimer ? nextPing : nextTimer);
+
+            PROBE(loop_sleep, num_connections, timeout);
+            r = poll(events, num_connections + 1, timeout);
+            PROBE(loop_wake, r);
+        }
 
         if (r > 0)
         {
@@ -87,6 +213,7 @@ static void *osdg_main(void *arg)
 
                         /* Read the eventfd in order to reset it */
                         read(events[i].fd, &buf, sizeof(buf));
+                        atomic_write(&wakePending, 0);
                         mainloop_handle_client_requests();
 
                         /* Ping interval for some connections could have been changed */
@@ -114,14 +241,47 @@ static void *osdg_main(void *arg)
         {
             return NULL; /* OS error code will be set */
         }
+
+        mainloop_update_snapshot(connections, num_connections);
     }
 
     main_loop_stop_cb();
     return NULL;
 }
 
+/* Failures are not fatal, the thread just runs where and how the OS likes */
+static void mainloop_set_thread_attr(pthread_attr_t *attr)
+{
+    int ret;
+
+    if (placement.pinned)
+    {
+        ret = pthread_attr_setaffinity_np(attr, sizeof(placement.cpus), &placement.cpus);
+        if (ret)
+            LOG(ERRORS, "Failed to set main loop CPU affinity, error %d", ret);
+    }
+
+    if (placement.policy != SCHED_OTHER)
+    {
+        struct sched_param param;
+
+        param.sched_priority = placement.priority;
+        ret = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+        if (!ret)
+            ret = pthread_attr_setschedpolicy(attr, placement.policy);
+        if (!ret)
+            ret = pthread_attr_setschedparam(attr, &param);
+        if (ret)
+        {
+            LOG(ERRORS, "Failed to set main loop scheduling policy %d, error %d", placement.policy, ret);
+            pthread_attr_setinheritsched(attr, PTHREAD_INHERIT_SCHED);
+        }
+    }
+}
+
 int mainloop_init(void)
 {
+    pthread_attr_t attr;
     int ret;
 
     events[0].fd = eventfd(0, 0);
@@ -131,10 +291,30 @@ int mainloop_init(void)
     events[0].events = POLLIN;
     stopFlag = 0;
 
-    ret = pthread_create(&thread, NULL, osdg_main, NULL);
+    pthread_attr_init(&attr);
+    mainloop_set_thread_attr(&attr);
+    event_init(&threadReady);
+
+    ret = pthread_create(&thread, &attr, osdg_main, NULL);
+    pthread_attr_destroy(&attr);
+
+    /* Realtime policy fails with EPERM if not privileged, bad CPUs with EINVAL */
+    if (ret && (placement.pinned || placement.policy != SCHED_OTHER))
+    {
+        LOG(ERRORS, "Failed to start main loop with requested placement, error %d; using defaults", ret);
+        ret = pthread_create(&thread, NULL, osdg_main, NULL);
+    }
+
     if (!ret)
+    {
+        /* Let local buffers get ready before the first connection needs them */
+        event_wait(&threadReady);
+        event_destroy(&threadReady);
+        running = 1;
         return 0;
+    }
 
+    event_destroy(&threadReady);
     closesocket(events[0].fd);
     errno = ret;
     return -1;
@@ -142,8 +322,9 @@ int mainloop_init(void)
 
 void mainloop_shutdown(void)
 {
-    stopFlag = 1;
+    atomic_write(&stopFlag, 1);
     mainloop_client_event();
     pthread_join(thread, NULL);
     closesocket(events[0].fd);
+    running = 0;
 }
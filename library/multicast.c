@@ -0,0 +1,225 @@
+#include <string.h>
+
+#include "client.h"
+#include "logging.h"
+#include "mainloop.h"
+
+#define MULTICAST_TIMEOUT (10 * MILLISECONDS_PER_SECOND)
+
+enum target_state
+{
+    target_pending,
+    target_opening,
+    target_done
+};
+
+struct multicast;
+
+struct multicast_target
+{
+    struct multicast       *mc;
+    osdg_connection_t       tunnel;
+    struct osdg_tunnel_user user;   /* Tells us when the tunnel is up */
+    timestamp_t             start;
+    enum target_state       state;
+};
+
+/* Lives on the main loop thread only, after it has been started */
+struct multicast
+{
+    struct mainloop_timer    timer;    /* Timeouts only, tunnel events drive the rest */
+    osdg_connection_t        grid;
+    char                     protocol[SDG_MAX_PROTOCOL_BYTES];
+    unsigned int             count;
+    unsigned int             next;     /* The first target, not started yet */
+    unsigned int             inFlight;
+    unsigned int             done;
+    unsigned int             concurrency;
+    osdg_multicast_cb_t      cb;
+    void                    *userData;
+    osdg_key_t              *peers;
+    osdg_result_t           *results;
+    struct multicast_target *targets;
+    int                      size;
+    unsigned char           *data;
+};
+
+static void multicast_complete(struct multicast_target *t, osdg_result_t result)
+{
+    struct multicast *mc = t->mc;
+
+    if (t->tunnel)
+    {
+        osdg_tunnel_release(t->tunnel, &t->user);
+        t->tunnel = NULL;
+    }
+
+    if (t->state == target_opening)
+        mc->inFlight--;
+
+    LOG(PROTOCOL, "Multicast %p: target %u done, result %d", mc, (unsigned int)(t - mc->targets), result);
+
+    t->state = target_done;
+    mc->results[t - mc->targets] = result;
+    mc->done++;
+}
+
+static void multicast_tunnel_done(struct multicast_target *t, enum osdg_connection_state state)
+{
+    osdg_result_t res;
+
+    if (state == osdg_connected)
+    {
+        /* Encrypted once, with this tunnel's session key */
+        res = osdg_send_data(t->tunnel, t->mc->data, t->mc->size);
+    }
+    else
+    {
+        /* A tunnel, closed without an error, has not delivered anything either */
+        res = osdg_get_last_result(t->tunnel);
+        if (res == osdg_no_error)
+            res = osdg_connection_failed;
+    }
+
+    multicast_complete(t, res);
+}
+
+/* Starts what the concurrency limit allows; either finishes and frees mc, or waits for events */
+static void multicast_advance(struct multicast *mc)
+{
+    timestamp_t now = timestamp();
+    timestamp_t deadline = TS_NEVER;
+    unsigned int i;
+
+    /* Start new targets in order, as long as the concurrency limit allows */
+    while (mc->next < mc->count && (!mc->concurrency || mc->inFlight < mc->concurrency))
+    {
+        struct multicast_target *t = &mc->targets[mc->next++];
+        osdg_result_t res = osdg_tunnel_acquire(mc->grid, mc->peers[t - mc->targets], mc->protocol,
+                                                &t->user, &t->tunnel);
+        enum osdg_connection_state state;
+
+        if (res != osdg_no_error)
+        {
+            t->tunnel = NULL;
+            multicast_complete(t, res);
+            continue;
+        }
+
+        /* Cached tunnels may be ready right away, the others tell us when they are */
+        state = osdg_get_connection_state(t->tunnel);
+        if (state != osdg_connecting)
+        {
+            multicast_tunnel_done(t, state);
+            continue;
+        }
+
+        t->start = now;
+        t->state = target_opening;
+        mc->inFlight++;
+    }
+
+    if (mc->done == mc->count)
+    {
+        mainloop_timer_stop(&mc->timer);
+        mc->cb(mc->results, mc->count, mc->userData);
+        free(mc);
+        return;
+    }
+
+    /* Wake up when the oldest opening target times out */
+    for (i = 0; i < mc->next; i++)
+    {
+        if (mc->targets[i].state == target_opening && mc->targets[i].start + MULTICAST_TIMEOUT < deadline)
+            deadline = mc->targets[i].start + MULTICAST_TIMEOUT;
+    }
+
+    mainloop_timer_start(&mc->timer, deadline > now ? deadline - now : 0);
+}
+
+/* Called on the main loop thread, like the timer */
+static void multicast_tunnel_state(osdg_connection_t tunnel, enum osdg_connection_state state, void *userData)
+{
+    struct multicast_target *t = userData;
+
+    if (t->state != target_opening || state == osdg_connecting)
+        return;
+
+    multicast_tunnel_done(t, state);
+    multicast_advance(t->mc);
+}
+
+static void multicast_run(struct mainloop_timer *timer)
+{
+    struct multicast *mc = (struct multicast *)timer;
+    timestamp_t now = timestamp();
+    unsigned int i;
+
+    for (i = 0; i < mc->next; i++)
+    {
+        struct multicast_target *t = &mc->targets[i];
+
+        if (t->state == target_opening && now - t->start >= MULTICAST_TIMEOUT)
+            multicast_complete(t, osdg_peer_timeout);
+    }
+
+    multicast_advance(mc);
+}
+
+osdg_result_t osdg_multicast(osdg_connection_t grid, const osdg_key_t *peers, unsigned int count, const char *protocol,
+                             const void *data, int size, unsigned int concurrency,
+                             osdg_multicast_cb_t cb, void *userData)
+{
+    struct multicast *mc;
+    size_t allocSize;
+    unsigned int i;
+
+    if (!count || size <= 0)
+        return osdg_invalid_parameters;
+
+#ifdef OSDG_STATIC_POOLS
+    /* Sized by the caller, so there's no fixed pool to take it from */
+    LOG(ERRORS, "Multicast is not available with static pools");
+    return osdg_memory_error;
+#endif
+
+    /* All in one block, freed at once */
+    allocSize = sizeof(struct multicast) + count * (sizeof(osdg_key_t) + sizeof(osdg_result_t) +
+                sizeof(struct multicast_target)) + size;
+    mc = malloc(allocSize);
+    if (!mc)
+        return osdg_memory_error;
+
+    mc->peers   = (osdg_key_t *)&mc[1];
+    mc->targets = (struct multicast_target *)&mc->peers[count];
+    mc->results = (osdg_result_t *)&mc->targets[count];
+    mc->data    = (unsigned char *)&mc->results[count];
+
+    mainloop_timer_init(&mc->timer, multicast_run);
+    mc->grid        = grid;
+    strncpy(mc->protocol, protocol, sizeof(mc->protocol) - 1);
+    mc->protocol[sizeof(mc->protocol) - 1] = 0;
+    mc->count       = count;
+    mc->next        = 0;
+    mc->inFlight    = 0;
+    mc->done        = 0;
+    mc->concurrency = concurrency;
+    mc->cb          = cb;
+    mc->userData    = userData;
+    mc->size        = size;
+    memcpy(mc->peers, peers, count * sizeof(osdg_key_t));
+    memcpy(mc->data, data, size);
+
+    for (i = 0; i < count; i++)
+    {
+        mc->targets[i].mc     = mc;
+        mc->targets[i].tunnel = NULL;
+        mc->targets[i].state  = target_pending;
+        mc->targets[i].user.changeState = multicast_tunnel_state;
+        mc->targets[i].user.receiveData = NULL;
+        mc->targets[i].user.userData    = &mc->targets[i];
+    }
+
+    mainloop_timer_start(&mc->timer, 0);
+    return osdg_no_error;
+}
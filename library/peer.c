@@ -1,11 +1,14 @@
 #include <ctype.h>
 #include <sodium.h>
+#include <string.h>
 
+#include "admission.h"
 #include "client.h"
 #include "control_protocol.h"
 #include "logging.h"
 #include "mainloop.h"
 #include "opensdg.h"
+#include "probes.h"
 #include "socket.h"
 
 static void registry_add_connection(struct _osdg_connection *peer)
@@ -17,12 +20,47 @@ static void registry_add_connection(struct _osdg_connection *peer)
     list_add(&peer->grid->forwardList, &peer->forwardReq);
 }
 
-static int peer_call_remote(struct _osdg_connection *peer)
+/* Peers, waiting to send MSG_CALL_REMOTE, still belong to the grid and go down with it */
+void registry_wait(struct _osdg_connection *peer)
+{
+    if (!peer->waitReq.next)
+        list_add(&peer->grid->waitList, &peer->waitReq);
+}
+
+static void peer_set_quirks(struct _osdg_connection *peer)
+{
+    /*
+     * DEVISmart thermostat has a quirk: very first packet is prefixed with
+     * a garbage byte, which has to be skipped.
+     * Apparently this is some buffering bug, which seems to have become a
+     * part of the protocol spec ;) The original DEVISmart app implements
+     * exactly this king of a logic in order to discard this byte: just remember
+     * the fact that the connection is new.
+     * Here we are generalizing this solution to "discard first N bytes", just
+     * in case. If there are more susceptible peers, they need to be listed here
+     * in order to prevent application writers from implementing the workaround
+     * over and over again.
+     */
+    if (!strcmp(peer->protocol, "dominion-1.0"))
+        peer->discardFirstBytes = 1;
+}
+
+int peer_send_call_remote(struct _osdg_connection *peer)
 {
     ConnectToPeer request = CONNECT_TO_PEER__INIT;
     char peerIdStr[crypto_box_PUBLICKEYBYTES * 2 + 1];
     osdg_result_t result;
 
+    if (peer->waitReq.next)
+        list_remove(&peer->waitReq);
+
+    /* The grid could have gone while we were waiting for admission */
+    if (peer->grid->state != osdg_connected)
+    {
+        peer->errorKind = osdg_connection_failed;
+        return -1;
+    }
+
     sodium_bin2hex(peerIdStr, sizeof(peerIdStr), peer->serverPubkey, sizeof(peer->serverPubkey));
 
     registry_add_connection(peer);
@@ -33,10 +71,38 @@ static int peer_call_remote(struct _osdg_connection *peer)
     request.peerid = peerIdStr;
     request.protocol = peer->protocol;
 
+    peer->callStart = timestamp();
     result = sendMESG(peer->grid, MSG_CALL_REMOTE, &request);
     return connection_set_result(peer, result);
 }
 
+static int peer_call_remote(struct _osdg_connection *peer)
+{
+    if (admission_acquire(peer, ADMIT_CALL))
+        return peer_send_call_remote(peer);
+
+    /* Queued, admission_run() will send the call later */
+    registry_wait(peer);
+    return 0;
+}
+
+/* Start over from MSG_CALL_REMOTE, called by the retry timer */
+int peer_retry(struct _osdg_connection *peer)
+{
+  peer_set_quirks(peer);
+  return peer_call_remote(peer);
+}
+
+int peer_connect_tunnel(struct _osdg_connection *peer)
+{
+    int ret = connect_to_host(peer, peer->pendingHost, peer->pendingPort);
+
+    if (ret == 0)
+        peer->errorKind = osdg_connection_failed;
+
+    return ret > 0 ? 0 : -1;
+}
+
 osdg_result_t osdg_connect_to_remote(osdg_connection_t grid, osdg_connection_t peer, const osdg_key_t peerId, const char *protocol)
 {
   int ret;
@@ -55,30 +121,35 @@ osdg_result_t osdg_connect_to_remote(osdg_connection_t grid, osdg_connection_t p
   memcpy(peer->clientSecret, grid->clientSecret, sizeof(peer->clientSecret));
   memcpy(peer->serverPubkey, peerId, sizeof(peer->serverPubkey));
   strncpy(peer->protocol, protocol, sizeof(peer->protocol));
+  PROBE(peer_connect, peer->connId, peer->serverPubkey, peer->protocol);
 
   char peerIdStr[crypto_box_PUBLICKEYBYTES * 2 + 1];
   sodium_bin2hex(peerIdStr, sizeof(peerIdStr), peer->serverPubkey, sizeof(peer->serverPubkey));
   LOG(PROTOCOL, " Peer[ ] osdg_connect_to_remote() %s:%s", peerIdStr, peer->protocol);
 
-  /*
-   * DEVISmart thermostat has a quirk: very first packet is prefixed with
-   * a garbage byte, which has to be skipped.
-   * Apparently this is some buffering bug, which seems to have become a
-   * part of the protocol spec ;) The original DEVISmart app implements
-   * exactly this king of a logic in order to discard this byte: just remember
-   * the fact that the connection is new.
-   * Here we are generalizing this solution to "discard first N bytes", just
-   * in case. If there are more susceptible peers, they need to be listed here
-   * in order to prevent application writers from implementing the workaround
-   * over and over again.
-   */
-  if (!strcmp(protocol, "dominion-1.0"))
-      peer->discardFirstBytes = 1;
+  peer_set_quirks(peer);
 
   mainloop_send_client_request(&peer->req, peer_call_remote);
   return osdg_no_error;
 }
 
+osdg_result_t osdg_set_forward_pipelining(osdg_connection_t conn, int enable)
+{
+    if (connection_in_use(conn))
+        return osdg_wrong_state;
+
+#ifndef OSDG_FORWARD_PIPELINING
+    if (enable)
+    {
+        LOG(ERRORS, "Forward pipelining is experimental and not built in");
+        return osdg_invalid_parameters;
+    }
+#endif
+
+    conn->pipelineForward = enable ? 1 : 0;
+    return osdg_no_error;
+}
+
 static osdg_result_t pairing_handle_incoming_packet(struct _osdg_connection *conn,
                                                     const void *p, unsigned int length)
 {
@@ -110,7 +181,7 @@ static osdg_result_t pairing_handle_incoming_packet(struct _osdg_connection *con
         int ret;
 
         if (!mesg)
-          return osdg_buffer_exceeded;
+          return conn->errorKind;
 
         payload = (struct mesg_payload *)(mesg->mesg_payload - crypto_box_BOXZEROBYTES);
         response = (struct PairingResponse *)payload->data.data;
@@ -252,7 +323,8 @@ osdg_result_t osdg_pair_remote(osdg_connection_t grid, osdg_connection_t peer, c
 
 int peer_handle_remote_call_reply(struct _osdg_connection *peer, PeerReply *reply)
 {
-    int ret;
+    admission_call_done(peer, !reply->result && reply->peer);
+    admission_release_slot(peer, ADMIT_CALL);
 
     if (reply->result || (!reply->peer))
     {
@@ -266,8 +338,9 @@ int peer_handle_remote_call_reply(struct _osdg_connection *peer, PeerReply *repl
          "Peer[%u] Forwarding ready at %s:%u tunnel", reply->id,
          reply->peer->server->host, reply->peer->server->port);
 
+    /* Tunnel ID only lives until MSG_FORWARD_REMOTE is sent, borrow a packet buffer for it */
     peer->tunnelIdSize = reply->peer->tunnelid.len;
-    peer->tunnelId = malloc(peer->tunnelIdSize);
+    peer->tunnelId = peer->tunnelIdSize <= peer->bufferSize ? client_get_buffer(peer) : NULL;
     if (!peer->tunnelId)
     {
         peer->errorKind = osdg_memory_error;
@@ -277,12 +350,13 @@ int peer_handle_remote_call_reply(struct _osdg_connection *peer, PeerReply *repl
 
     memcpy(peer->tunnelId, reply->peer->tunnelid.data, peer->tunnelIdSize);
 
-    ret = connect_to_host(peer, reply->peer->server->host, reply->peer->server->port);
-    if (ret == 0)
-    {
-        peer->errorKind = osdg_connection_failed;
+    /* The reply is freed on return, so remember the forwarder in case we're queued */
+    strncpy(peer->pendingHost, reply->peer->server->host, sizeof(peer->pendingHost) - 1);
+    peer->pendingHost[sizeof(peer->pendingHost) - 1] = 0;
+    peer->pendingPort = reply->peer->server->port;
+
+    if (admission_acquire(peer, ADMIT_HANDSHAKE) && peer_connect_tunnel(peer))
         connection_terminate(peer, osdg_error);
-    }
 
     return 0; /* We never abort grid connection */
 }
@@ -297,10 +371,15 @@ osdg_result_t osdg_send_data(osdg_connection_t conn, const void *data, int size)
 
     mesg = get_MESG_packet(conn, size);
     if (!mesg)
-        return osdg_buffer_exceeded;
+        return conn->errorKind;
 
     payload = (struct mesg_payload *)(mesg->mesg_payload - crypto_box_BOXZEROBYTES);
     memcpy(payload->data.data, data, size);
 
     return send_MESG_packet(conn, mesg);
 }
+
+unsigned int osdg_get_max_send_size(osdg_connection_t conn)
+{
+    return conn->bufferSize - sizeof(struct packetMESG);
+}
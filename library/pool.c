@@ -0,0 +1,218 @@
+#include <string.h>
+
+#include "atomic_wrapper.h"
+#include "client.h"
+#include "logging.h"
+#include "pool.h"
+#include "utils.h"
+
+#ifdef OSDG_STATIC_POOLS
+
+#ifndef OSDG_POOL_BUFFER_SIZE
+#define OSDG_POOL_BUFFER_SIZE DEFAULT_BUFFER_SIZE
+#endif
+#ifndef OSDG_PB_ARENA_SIZE
+#define OSDG_PB_ARENA_SIZE 8192
+#endif
+
+#define ARENA_ALIGN sizeof(long long)
+
+union connection_block
+{
+    struct queue_element    qe;
+    struct _osdg_connection conn;
+};
+
+union buffer_block
+{
+    struct queue_element qe;
+    long long            align;
+    unsigned char        data[OSDG_POOL_BUFFER_SIZE];
+};
+
+static union connection_block connectionPool[OSDG_POOL_CONNECTIONS];
+static union buffer_block     bufferPool[OSDG_POOL_BUFFERS];
+static struct queue           freeConnections;
+static struct queue           freeBuffers;
+
+static union
+{
+    long long     align;
+    unsigned char data[OSDG_PB_ARENA_SIZE];
+} arena;
+static size_t       arenaUsed;
+static unsigned int arenaBlocks;
+
+void pool_init(void)
+{
+    unsigned int i;
+
+    queue_init(&freeConnections);
+    queue_init(&freeBuffers);
+
+    for (i = 0; i < OSDG_POOL_CONNECTIONS; i++)
+        queue_put_nolock(&freeConnections, &connectionPool[i].qe);
+    for (i = 0; i < OSDG_POOL_BUFFERS; i++)
+        queue_put_nolock(&freeBuffers, &bufferPool[i].qe);
+
+    arenaUsed   = 0;
+    arenaBlocks = 0;
+}
+
+void pool_shutdown(void)
+{
+    queue_destroy(&freeConnections);
+    queue_destroy(&freeBuffers);
+}
+
+void *pool_get_connection(size_t size)
+{
+    void *conn = queue_get(&freeConnections);
+
+    if (!conn)
+        LOG(ERRORS, "Connection pool of %u exhausted", OSDG_POOL_CONNECTIONS);
+
+    return conn;
+}
+
+void pool_put_connection(void *conn)
+{
+    queue_put(&freeConnections, conn);
+}
+
+void *pool_get_buffer(size_t size)
+{
+    void *buffer;
+
+    if (size > OSDG_POOL_BUFFER_SIZE)
+        return NULL;
+
+    buffer = queue_get(&freeBuffers);
+    if (!buffer)
+        LOG(ERRORS, "Buffer pool of %u exhausted", OSDG_POOL_BUFFERS);
+
+    return buffer;
+}
+
+void pool_put_buffer(void *buffer, size_t size)
+{
+    queue_put(&freeBuffers, buffer);
+}
+
+/*
+ * A message is always freed before the next one is unpacked, so a simple
+ * bump allocator suffices. It rewinds when the last block is released.
+ */
+static void *arena_alloc(void *data, size_t size)
+{
+    void *ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (arenaUsed + size > sizeof(arena.data))
+    {
+        LOG(ERRORS, "Protobuf arena of %u bytes exhausted", OSDG_PB_ARENA_SIZE);
+        return NULL;
+    }
+
+    ptr = &arena.data[arenaUsed];
+    arenaUsed += size;
+    arenaBlocks++;
+
+    return ptr;
+}
+
+static void arena_free(void *data, void *ptr)
+{
+    if (--arenaBlocks == 0)
+        arenaUsed = 0;
+}
+
+ProtobufCAllocator pb_arena =
+{
+    arena_alloc,
+    arena_free,
+    NULL
+};
+
+int pool_allocate_local_buffers(unsigned int count)
+{
+    return 0;
+}
+
+#else
+
+/* Spare heap buffers, kept for reuse on top of the local region */
+#define MAX_SPARE_BUFFERS 64
+
+/*
+ * Buffers are shared by all connections and only held while a packet is in flight.
+ * Node-local buffers live in a single region, so that pool_put_buffer() can tell
+ * them from plain malloc()ed ones. The region is kept for the process lifetime
+ * because connections may outlive osdg_shutdown().
+ */
+static struct queue   freeBuffers = { NULL, (struct queue_element *)&freeBuffers.head, PTHREAD_MUTEX_INITIALIZER };
+static unsigned int   freeCount;
+static unsigned int   localCount;
+static unsigned char *localRegion;
+static size_t         localRegionSize;
+
+int pool_allocate_local_buffers(unsigned int count)
+{
+    unsigned int i;
+
+    if (localRegion)
+        return 0; /* Already done by previous osdg_init() */
+
+    localRegionSize = (size_t)count * DEFAULT_BUFFER_SIZE;
+    localRegion = malloc(localRegionSize);
+    if (!localRegion)
+        return -1;
+
+    /* Touch every page from this thread */
+    memset(localRegion, 0, localRegionSize);
+
+    for (i = 0; i < count; i++)
+        pool_put_buffer(&localRegion[i * DEFAULT_BUFFER_SIZE], DEFAULT_BUFFER_SIZE);
+
+    atomic_write(&localCount, count);
+    return 0;
+}
+
+void *pool_get_buffer(size_t size)
+{
+    void *buffer = NULL;
+
+    /* Only default size buffers are in the pool */
+    if (size <= DEFAULT_BUFFER_SIZE)
+    {
+        buffer = queue_get(&freeBuffers);
+        if (buffer)
+            atomic_sub(&freeCount, 1);
+    }
+
+    return buffer ? buffer : malloc(size < DEFAULT_BUFFER_SIZE ? DEFAULT_BUFFER_SIZE : size);
+}
+
+void pool_put_buffer(void *buffer, size_t size)
+{
+    unsigned char *p = buffer;
+    int local = localRegion && p >= localRegion && p < localRegion + localRegionSize;
+
+    /*
+     * Larger buffers, used by connections with bigger bufferSize, would be
+     * wasted on default size requests, so they are freed.
+     * The limit is approximate, which is fine.
+     */
+    if (local || (size <= DEFAULT_BUFFER_SIZE &&
+                  atomic_read(&freeCount) < atomic_read(&localCount) + MAX_SPARE_BUFFERS))
+    {
+        queue_put(&freeBuffers, buffer);
+        atomic_add(&freeCount, 1);
+    }
+    else
+    {
+        free(buffer);
+    }
+}
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef INTERNAL_POOL_H
+#define INTERNAL_POOL_H
+
+#include <stdlib.h>
+
+#include "control_protocol.pb-c.h"
+
+/* This buffer size is used by original mdglib from DEVISmart Android APK */
+#define DEFAULT_BUFFER_SIZE 1536
+
+/*
+ * Memory for connections, packet buffers and unpacked protobuf messages.
+ * With STATIC_POOLS cmake option everything comes from static pools, sized
+ * at build time, so that long-running embedded gateways never fragment the heap.
+ * Otherwise these are thin malloc() wrappers.
+ */
+#ifdef OSDG_STATIC_POOLS
+
+#ifndef OSDG_POOL_CONNECTIONS
+#define OSDG_POOL_CONNECTIONS 16
+#endif
+#ifndef OSDG_POOL_BUFFERS
+#define OSDG_POOL_BUFFERS (OSDG_POOL_CONNECTIONS * 4)
+#endif
+
+void pool_init(void);
+void pool_shutdown(void);
+void *pool_get_connection(size_t size);
+void pool_put_connection(void *conn);
+void *pool_get_buffer(size_t size);
+void pool_put_buffer(void *buffer, size_t size);
+
+/* Protobuf messages are only unpacked on the main loop thread */
+extern ProtobufCAllocator pb_arena;
+#define PB_ALLOCATOR (&pb_arena)
+
+#else
+
+static inline void pool_init(void)
+{
+}
+
+static inline void pool_shutdown(void)
+{
+}
+
+#define pool_get_connection(size) malloc(size)
+#define pool_put_connection(conn) free(conn)
+
+void *pool_get_buffer(size_t size);
+void pool_put_buffer(void *buffer, size_t size);
+
+#define PB_ALLOCATOR NULL
+
+#endif
+
+/*
+ * Preallocate packet buffers; called by the main loop thread, so that
+ * first-touch policy places them on its own NUMA node.
+ * Static pools are placed by osdg_init() caller, this is a no-op for them.
+ */
+int pool_allocate_local_buffers(unsigned int count);
+
+#endif
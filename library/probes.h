@@ -0,0 +1,27 @@
+#ifndef INTERNAL_PROBES_H
+#define INTERNAL_PROBES_H
+
+/*
+ * USDT (SystemTap-style) static tracepoints, enabled by USDT_PROBES cmake option.
+ * Every probe compiles to a single nop, which is patched only while a tracer,
+ * like bpftrace or perf, is attached. Provider name is "opensdg".
+ * The first argument of every connection-related probe is a connection ID,
+ * as returned by osdg_get_connection_id().
+ */
+#ifdef OSDG_USDT
+
+#include <sys/sdt.h>
+
+#define PROBE(name, ...) STAP_PROBEV(opensdg, name, ##__VA_ARGS__)
+
+#else
+
+#define PROBE(name, ...)
+
+#endif
+
+/* Callback types for callback_entry and callback_return probes */
+#define PROBE_CB_STATE 0
+#define PROBE_CB_DATA  1
+
+#endif
@@ -0,0 +1,55 @@
+#include <string.h>
+
+#include "atomic_wrapper.h"
+#include "profiling.h"
+
+#ifdef OSDG_PROFILE
+
+static struct osdg_stage_stats stage_stats[osdg_stage_max];
+
+void prof_account(enum osdg_stage stage, prof_time_t start)
+{
+    struct osdg_stage_stats *s = &stage_stats[stage];
+    unsigned long long duration = prof_now() - start;
+    unsigned int bucket = duration ? 63 - __builtin_clzll(duration) : 0;
+
+    if (bucket >= OSDG_STAGE_BUCKETS)
+        bucket = OSDG_STAGE_BUCKETS - 1;
+
+    /* Encryption and sending can happen on any thread */
+    atomic_add(&s->count, 1);
+    atomic_add(&s->total, duration);
+    atomic_add(&s->histogram[bucket], 1);
+
+    /* Not exact under a race, good enough for statistics */
+    if (duration > s->max)
+        s->max = duration;
+}
+
+osdg_result_t osdg_get_stage_stats(struct osdg_stage_stats *stats, unsigned int count)
+{
+    if (count > osdg_stage_max)
+        count = osdg_stage_max;
+
+    memcpy(stats, stage_stats, count * sizeof(struct osdg_stage_stats));
+    return osdg_no_error;
+}
+
+void osdg_reset_stage_stats(void)
+{
+    memset(stage_stats, 0, sizeof(stage_stats));
+}
+
+#else
+
+osdg_result_t osdg_get_stage_stats(struct osdg_stage_stats *stats, unsigned int count)
+{
+    /* The library was built without PROFILE_STAGES */
+    return osdg_invalid_parameters;
+}
+
+void osdg_reset_stage_stats(void)
+{
+}
+
+#endif
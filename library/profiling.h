@@ -0,0 +1,36 @@
+#ifndef INTERNAL_PROFILING_H
+#define INTERNAL_PROFILING_H
+
+#include "opensdg.h"
+
+/*
+ * Per-stage packet processing timers, enabled by PROFILE_STAGES cmake option.
+ * Without it all the macros below compile to nothing.
+ */
+#ifdef OSDG_PROFILE
+
+#include <time.h>
+
+typedef unsigned long long prof_time_t;
+
+static inline prof_time_t prof_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void prof_account(enum osdg_stage stage, prof_time_t start);
+
+#define PROF_START(var)      prof_time_t var = prof_now()
+#define PROF_END(stage, var) prof_account(osdg_stage_ ## stage, var)
+
+#else
+
+#define PROF_START(var)
+#define PROF_END(stage, var)
+
+#endif
+
+#endif
@@ -0,0 +1,116 @@
+#include "admission.h"
+#include "client.h"
+#include "logging.h"
+#include "pthread_wrapper.h"
+#include "retry.h"
+#include "socket.h"
+
+/*
+ * Nothing is retried unless the application asks for it; failures are reported
+ * right away, as they always were.
+ */
+static struct osdg_retry_policy policies[osdg_retry_class_max] =
+{
+    { 0, 0, 0, 1 }, /* osdg_retry_server_error */
+    { 0, 0, 0, 1 }, /* osdg_retry_peer_timeout */
+    { 0, 0, 0, 1 }, /* osdg_retry_refused */
+    { 0, 0, 0, 1 }, /* osdg_retry_connect_failed */
+};
+/* Policies are set by the application's thread and read by the main loop */
+static pthread_mutex_t policyLock = PTHREAD_MUTEX_INITIALIZER;
+
+osdg_result_t osdg_set_retry_policy(enum osdg_retry_class cls, const struct osdg_retry_policy *policy)
+{
+    if (cls >= osdg_retry_class_max)
+        return osdg_invalid_parameters;
+
+    pthread_mutex_lock(&policyLock);
+    policies[cls] = *policy;
+    pthread_mutex_unlock(&policyLock);
+
+    return osdg_no_error;
+}
+
+static int retry_classify(osdg_result_t error)
+{
+    switch (error)
+    {
+    case osdg_server_error:
+        return osdg_retry_server_error;
+    case osdg_peer_timeout:
+        return osdg_retry_peer_timeout;
+    case osdg_connection_refused:
+        return osdg_retry_refused;
+    case osdg_connection_failed:
+        return osdg_retry_connect_failed;
+    default:
+        return -1;
+    }
+}
+
+static unsigned int retry_delay(const struct osdg_retry_policy *p, unsigned int attempt)
+{
+    unsigned int delay = p->delay;
+
+    while (attempt--)
+    {
+        delay *= p->backoff ? p->backoff : 1;
+        if (p->maxDelay && delay >= p->maxDelay)
+            return p->maxDelay;
+    }
+
+    return delay;
+}
+
+static void retry_fire(struct mainloop_timer *t)
+{
+    struct _osdg_connection *conn = (struct _osdg_connection *)((char *)t - offsetof(struct _osdg_connection, retryTimer));
+
+    if (peer_retry(conn))
+        connection_terminate(conn, osdg_error);
+}
+
+int connection_retry(struct _osdg_connection *conn)
+{
+    int cls = retry_classify(conn->errorKind);
+    struct osdg_retry_policy p;
+    unsigned int delay;
+
+    if (cls < 0)
+        return 0;
+
+    /* Nobody to send MSG_CALL_REMOTE to; the grid is also down while tearing down its peers */
+    if (conn->grid->state != osdg_connected || conn->grid->sock == -1)
+        return 0;
+
+    pthread_mutex_lock(&policyLock);
+    p = policies[cls];
+    pthread_mutex_unlock(&policyLock);
+
+    if (conn->retryCount >= p.maxRetries)
+        return 0;
+
+    delay = retry_delay(&p, conn->retryCount);
+    conn->retryCount++;
+
+    LOG(CONNECTION, "Conn[%u] failed with error %d; retry %u of %u in %u ms",
+        conn->connId, conn->errorKind, conn->retryCount, p.maxRetries, delay);
+
+    /* Drop everything, related to the failed attempt */
+    mainloop_remove_connection(conn);
+    connection_shutdown(conn);
+    admission_release(conn);
+    if (conn->forwardReq.next)
+        list_remove(&conn->forwardReq);
+    /* Still belongs to the grid, so that it's terminated with it */
+    registry_wait(conn);
+
+    conn->errorKind      = osdg_no_error;
+    conn->errorCode      = 0;
+    conn->forwardPending = 0;
+    conn->bytesLeft      = 0;
+
+    mainloop_timer_init(&conn->retryTimer, retry_fire);
+    mainloop_timer_start(&conn->retryTimer, delay);
+    return 1;
+}
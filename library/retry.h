@@ -0,0 +1,13 @@
+#ifndef INTERNAL_RETRY_H
+#define INTERNAL_RETRY_H
+
+struct _osdg_connection;
+
+/*
+ * Called instead of terminating a failed peer connection. Returns nonzero if
+ * the retry policy for the error wants another attempt; the connection stays
+ * in connecting state then, and the attempt is scheduled.
+ */
+int connection_retry(struct _osdg_connection *conn);
+
+#endif
@@ -0,0 +1,291 @@
+#include <sodium.h>
+#include <string.h>
+
+#include "client.h"
+#include "logging.h"
+#include "mainloop.h"
+#include "pool.h"
+
+/* How long to wait for a newly opened tunnel before skipping the round */
+#define CONNECT_WAIT_TIMEOUT (10 * MILLISECONDS_PER_SECOND)
+
+/* Period adaptation: faster when something changes, slowly back off otherwise */
+#define PERIOD_SHRINK_DIV 2
+#define PERIOD_GROW_DIV   4 /* +25% */
+#define JITTER_PERCENT    10
+
+struct _osdg_poll_job
+{
+    struct mainloop_timer timer;
+    osdg_connection_t     grid;
+    osdg_key_t            peerId;
+    char                  protocol[SDG_MAX_PROTOCOL_BYTES];
+    unsigned int          period;     /* Current, in milliseconds */
+    unsigned int          minPeriod;
+    unsigned int          maxPeriod;
+    osdg_poll_cb_t        cb;
+    void                 *userData;
+    osdg_connection_t     tunnel;     /* Held while the job is in progress */
+    struct osdg_tunnel_user user;     /* Tells us when the tunnel is up */
+    char                  inProgress; /* Callback called, osdg_poll_job_done() not yet */
+    char                  dead;       /* Destroyed by the application */
+    struct _osdg_poll_job *nextFree;  /* In the static pool */
+};
+
+/*
+ * Protects job state. A job is only ever freed by its own timer callback,
+ * so a timer, which is firing right now, never touches freed memory.
+ */
+static pthread_mutex_t schedLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int    jobCount;
+
+#ifdef OSDG_STATIC_POOLS
+
+#ifndef OSDG_POOL_JOBS
+#define OSDG_POOL_JOBS OSDG_POOL_CONNECTIONS
+#endif
+
+/* Protected by schedLock */
+static struct _osdg_poll_job jobPool[OSDG_POOL_JOBS];
+static struct _osdg_poll_job *freeJobs;
+static unsigned int           jobHighWater;
+
+static struct _osdg_poll_job *job_alloc(void)
+{
+    struct _osdg_poll_job *job = NULL;
+
+    pthread_mutex_lock(&schedLock);
+
+    if (freeJobs)
+    {
+        job = freeJobs;
+        freeJobs = job->nextFree;
+    }
+    else if (jobHighWater < OSDG_POOL_JOBS)
+    {
+        job = &jobPool[jobHighWater++];
+    }
+
+    pthread_mutex_unlock(&schedLock);
+
+    if (!job)
+        LOG(ERRORS, "Poll job pool of %u exhausted", OSDG_POOL_JOBS);
+
+    return job;
+}
+
+static void job_free(struct _osdg_poll_job *job)
+{
+    pthread_mutex_lock(&schedLock);
+    job->nextFree = freeJobs;
+    freeJobs = job;
+    pthread_mutex_unlock(&schedLock);
+}
+
+#else
+
+#define job_alloc() malloc(sizeof(struct _osdg_poll_job))
+#define job_free(job) free(job)
+
+#endif
+
+static unsigned int add_jitter(unsigned int period)
+{
+    unsigned int range = period * JITTER_PERCENT / 100;
+
+    return range ? period - range + randombytes_uniform(range * 2 + 1) : period;
+}
+
+/* Called with schedLock held, which is released */
+static void poll_job_run(struct _osdg_poll_job *job)
+{
+    mainloop_timer_stop(&job->timer);
+    job->inProgress = 1;
+    pthread_mutex_unlock(&schedLock);
+    job->cb(job, job->tunnel, job->userData);
+}
+
+/* Called with schedLock held */
+static void poll_job_skip(struct _osdg_poll_job *job, const char *reason)
+{
+    LOG(CONNECTION, "Poll job %p: %s; skipping the round", job, reason);
+
+    if (job->tunnel)
+    {
+        osdg_tunnel_release(job->tunnel, &job->user);
+        job->tunnel = NULL;
+    }
+
+    mainloop_timer_start(&job->timer, add_jitter(job->period));
+}
+
+/* Tunnel events come on the main loop thread, just like timers, so they never race with freeing */
+static void poll_job_tunnel_state(osdg_connection_t tunnel, enum osdg_connection_state state, void *userData)
+{
+    struct _osdg_poll_job *job = userData;
+
+    pthread_mutex_lock(&schedLock);
+
+    /* Only the tunnel coming up or failing before the round has started matters */
+    if (job->tunnel != tunnel || job->inProgress || job->dead)
+    {
+        pthread_mutex_unlock(&schedLock);
+        return;
+    }
+
+    if (state == osdg_connected)
+    {
+        poll_job_run(job);
+        return;
+    }
+
+    poll_job_skip(job, "tunnel failed");
+    pthread_mutex_unlock(&schedLock);
+}
+
+static void poll_job_fire(struct mainloop_timer *t)
+{
+    struct _osdg_poll_job *job = (struct _osdg_poll_job *)t;
+    osdg_result_t res;
+
+    pthread_mutex_lock(&schedLock);
+
+    if (job->dead)
+    {
+        if (job->inProgress)
+        {
+            /* osdg_poll_job_done() will get us here again */
+            pthread_mutex_unlock(&schedLock);
+            return;
+        }
+
+        if (job->tunnel)
+            osdg_tunnel_release(job->tunnel, &job->user);
+
+        mainloop_timer_stop(&job->timer);
+        pthread_mutex_unlock(&schedLock);
+        job_free(job);
+        return;
+    }
+
+    /* Still waiting for the tunnel */
+    if (job->tunnel)
+    {
+        poll_job_skip(job, "tunnel timeout");
+        pthread_mutex_unlock(&schedLock);
+        return;
+    }
+
+    res = osdg_tunnel_acquire(job->grid, job->peerId, job->protocol, &job->user, &job->tunnel);
+    if (res != osdg_no_error)
+    {
+        LOG(CONNECTION, "Poll job %p: no tunnel, error %d; skipping the round", job, res);
+        job->tunnel = NULL;
+        mainloop_timer_start(&job->timer, add_jitter(job->period));
+        pthread_mutex_unlock(&schedLock);
+        return;
+    }
+
+    switch (osdg_get_connection_state(job->tunnel))
+    {
+    case osdg_connected:
+        poll_job_run(job);
+        return;
+
+    case osdg_connecting:
+        /* poll_job_tunnel_state() takes over; the timer is only a timeout now */
+        mainloop_timer_start(&job->timer, CONNECT_WAIT_TIMEOUT);
+        break;
+
+    default:
+        poll_job_skip(job, "tunnel failed");
+        break;
+    }
+
+    pthread_mutex_unlock(&schedLock);
+}
+
+osdg_poll_job_t osdg_poll_job_create(osdg_connection_t grid, const osdg_key_t peerId, const char *protocol,
+                                     unsigned int minPeriod, unsigned int maxPeriod,
+                                     osdg_poll_cb_t cb, void *userData)
+{
+    struct _osdg_poll_job *job;
+    unsigned long long phase;
+
+    if (!minPeriod || maxPeriod < minPeriod)
+        return NULL;
+
+    job = job_alloc();
+    if (!job)
+        return NULL;
+
+    mainloop_timer_init(&job->timer, poll_job_fire);
+    job->grid       = grid;
+    memcpy(job->peerId, peerId, sizeof(job->peerId));
+    strncpy(job->protocol, protocol, sizeof(job->protocol));
+    job->period     = minPeriod;
+    job->minPeriod  = minPeriod;
+    job->maxPeriod  = maxPeriod;
+    job->cb         = cb;
+    job->userData   = userData;
+    job->tunnel     = NULL;
+    job->user.changeState = poll_job_tunnel_state;
+    job->user.receiveData = NULL;
+    job->user.userData    = job;
+    job->inProgress = 0;
+    job->dead       = 0;
+
+    /*
+     * Fractional parts of n * golden ratio are spread evenly over [0, 1)
+     * for any number of jobs, so the first runs never bunch up, no matter
+     * how many jobs get added later.
+     */
+    pthread_mutex_lock(&schedLock);
+    phase = (jobCount++ * 0x9E3779B9ULL) & 0xFFFFFFFFULL;
+    mainloop_timer_start(&job->timer, (unsigned int)((phase * minPeriod) >> 32));
+    pthread_mutex_unlock(&schedLock);
+
+    return job;
+}
+
+void osdg_poll_job_done(osdg_poll_job_t job, int changed)
+{
+    pthread_mutex_lock(&schedLock);
+
+    job->inProgress = 0;
+    osdg_tunnel_release(job->tunnel, &job->user);
+    job->tunnel = NULL;
+
+    if (changed)
+    {
+        job->period /= PERIOD_SHRINK_DIV;
+        if (job->period < job->minPeriod)
+            job->period = job->minPeriod;
+    }
+    else
+    {
+        job->period += job->period / PERIOD_GROW_DIV + 1;
+        if (job->period > job->maxPeriod)
+            job->period = job->maxPeriod;
+    }
+
+    /* A dead job is freed by its timer */
+    mainloop_timer_start(&job->timer, job->dead ? 0 : add_jitter(job->period));
+
+    pthread_mutex_unlock(&schedLock);
+}
+
+void osdg_poll_job_destroy(osdg_poll_job_t job)
+{
+    pthread_mutex_lock(&schedLock);
+
+    job->dead = 1;
+    mainloop_timer_start(&job->timer, 0);
+
+    pthread_mutex_unlock(&schedLock);
+}
+
+unsigned int osdg_poll_job_get_period(osdg_poll_job_t job)
+{
+    return job->period;
+}
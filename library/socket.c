@@ -1,5 +1,6 @@
 #include "client.h"
 #include "mainloop.h"
+#include "profiling.h"
 #include "socket.h"
 
 #include <sys/select.h>
@@ -117,9 +118,12 @@ int connect_to_host(struct _osdg_connection *client, const char *host, unsigned
     return res;
 }
 
-int receive_data(struct _osdg_connection *client) {
+int receive_data(struct _osdg_connection *client, unsigned char *buffer) {
     while (client->bytesLeft) {			// bytesLeft: number of packet bytes still to be received
-        int ret = recv(client->sock, &client->receiveBuffer[client->bytesReceived], client->bytesLeft, 0);
+        PROF_START(t);
+        int ret = recv(client->sock, &buffer[client->bytesReceived], client->bytesLeft, 0);
+        PROF_END(recv, t);
+
         if (ret < 0) {
             int err = errno;
             if (err == EWOULDBLOCK) {
@@ -147,7 +151,9 @@ int receive_data(struct _osdg_connection *client) {
 /* For simplicity this function is currently blocking */
 osdg_result_t send_data(const unsigned char *buffer, int size, struct _osdg_connection *client) {
     while (size) {
+        PROF_START(t);
         int ret = send(client->sock, buffer, size, 0);		// returns the number sent or -1
+        PROF_END(send, t);
 
         if (ret >= 0) {
 			size   -= ret;
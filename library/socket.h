@@ -7,7 +7,7 @@
 
 int closesocket(int s);
 int connect_to_host(struct _osdg_connection *client, const char *host, unsigned short port);
-int receive_data(struct _osdg_connection *client);
+int receive_data(struct _osdg_connection *client, unsigned char *buffer);
 osdg_result_t send_data(const unsigned char *buffer, int size, struct _osdg_connection *client);
 
 #endif
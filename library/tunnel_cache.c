@@ -0,0 +1,337 @@
+#include <string.h>
+
+#include "client.h"
+#include "logging.h"
+#include "tunnel_cache.h"
+
+#define CACHE_BUCKETS 64
+
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static int             cacheReady;
+static struct list     buckets[CACHE_BUCKETS]; /* Hashed by peer ID only, for per-device counting */
+static struct list     lru;                    /* Idle tunnels, least recently used first */
+static unsigned int    maxTunnels = 32;        /* 0 means unlimited */
+static unsigned int    maxPerDevice = 2;
+static struct osdg_tunnel_cache_stats stats;
+/* Next user to get the event being dispatched, kept valid by osdg_tunnel_release() */
+static struct osdg_tunnel_user *dispatchNext;
+
+static inline struct _osdg_connection *get_hashed_connection(struct list_element *e)
+{
+    return (struct _osdg_connection *)((char *)e - offsetof(struct _osdg_connection, cacheEntry.hashReq));
+}
+
+static inline struct _osdg_connection *get_idle_connection(struct list_element *e)
+{
+    return (struct _osdg_connection *)((char *)e - offsetof(struct _osdg_connection, cacheEntry.lruReq));
+}
+
+static inline struct list *get_bucket(const osdg_key_t peerId)
+{
+    /* Peer IDs are public keys, so any bytes are random enough */
+    return &buckets[(peerId[0] | (peerId[1] << 8)) % CACHE_BUCKETS];
+}
+
+static void cache_init(void)
+{
+    unsigned int i;
+
+    if (cacheReady)
+        return;
+
+    for (i = 0; i < CACHE_BUCKETS; i++)
+        list_init(&buckets[i]);
+    list_init(&lru);
+
+    cacheReady = 1;
+}
+
+/* Callbacks are called unlocked, users may acquire and release tunnels from them */
+static void cache_state_changed(osdg_connection_t conn, enum osdg_connection_state state)
+{
+    struct osdg_tunnel_user *u;
+
+    pthread_mutex_lock(&cacheLock);
+
+    for (u = conn->cacheEntry.users; u; u = dispatchNext)
+    {
+        osdg_tunnel_state_cb_t cb = u->changeState;
+        void *userData = u->userData;
+
+        dispatchNext = u->next;
+        if (cb)
+        {
+            pthread_mutex_unlock(&cacheLock);
+            cb(conn, state, userData);
+            pthread_mutex_lock(&cacheLock);
+        }
+    }
+
+    dispatchNext = NULL;
+    pthread_mutex_unlock(&cacheLock);
+}
+
+static osdg_result_t cache_receive_data(osdg_connection_t conn, const void *data, unsigned int length)
+{
+    struct osdg_tunnel_user *u;
+    osdg_result_t ret = osdg_no_error;
+
+    pthread_mutex_lock(&cacheLock);
+
+    for (u = conn->cacheEntry.users; u; u = dispatchNext)
+    {
+        osdg_tunnel_receive_cb_t cb = u->receiveData;
+        void *userData = u->userData;
+
+        dispatchNext = u->next;
+        if (cb)
+        {
+            osdg_result_t res;
+
+            pthread_mutex_unlock(&cacheLock);
+            res = cb(conn, data, length, userData);
+            pthread_mutex_lock(&cacheLock);
+
+            /* The first error aborts the tunnel, but everybody sees the data */
+            if (ret == osdg_no_error)
+                ret = res;
+        }
+    }
+
+    dispatchNext = NULL;
+    pthread_mutex_unlock(&cacheLock);
+    return ret;
+}
+
+static void cache_add_user(struct _osdg_connection *conn, struct osdg_tunnel_user *user)
+{
+    struct osdg_tunnel_user **u;
+
+    if (!user)
+        return;
+
+    for (u = &conn->cacheEntry.users; *u; u = &(*u)->next);
+
+    user->next = NULL;
+    *u = user;
+}
+
+static void cache_remove_user(struct _osdg_connection *conn, struct osdg_tunnel_user *user)
+{
+    struct osdg_tunnel_user **u;
+
+    if (!user)
+        return;
+
+    for (u = &conn->cacheEntry.users; *u; u = &(*u)->next)
+    {
+        if (*u == user)
+        {
+            *u = user->next;
+            if (dispatchNext == user)
+                dispatchNext = user->next;
+            break;
+        }
+    }
+}
+
+static int tunnel_cache_destroy(struct _osdg_connection *conn)
+{
+    osdg_connection_destroy(conn);
+    return 0;
+}
+
+/* Unlink from the cache. The connection is destroyed when the last user releases it. */
+static void cache_remove(struct _osdg_connection *conn)
+{
+    struct tunnel_cache_entry *e = &conn->cacheEntry;
+
+    list_remove(&e->hashReq);
+    if (!e->refs)
+    {
+        list_remove(&e->lruReq);
+        stats.idle--;
+    }
+
+    e->dead = 1;
+    stats.tunnels--;
+}
+
+/* Deferred to the main loop, which may still be running our callbacks */
+static void cache_destroy(struct _osdg_connection *conn)
+{
+    mainloop_send_client_request(&conn->req, tunnel_cache_destroy);
+}
+
+static int cache_evict(struct _osdg_connection *conn)
+{
+    LOG(CONNECTION, "Conn[%u] evicting idle tunnel", conn->connId);
+
+    cache_remove(conn);
+    stats.evictions++;
+
+    /* If closing is already in progress, the tunnel will die by itself */
+    osdg_connection_close(conn);
+    return 0;
+}
+
+/* Evict the least recently used idle tunnel, optionally only to the given device */
+static int cache_evict_lru(const osdg_key_t peerId)
+{
+    struct list_element *e;
+
+    for (e = lru.head; e->next; e = e->next)
+    {
+        struct _osdg_connection *conn = get_idle_connection(e);
+
+        if (!peerId || !memcmp(conn->serverPubkey, peerId, sizeof(osdg_key_t)))
+            return !cache_evict(conn);
+    }
+
+    return 0;
+}
+
+osdg_result_t osdg_tunnel_acquire(osdg_connection_t grid, const osdg_key_t peerId, const char *protocol,
+                                  struct osdg_tunnel_user *user, osdg_connection_t *tunnel)
+{
+    struct list *bucket = get_bucket(peerId);
+    struct list_element *e;
+    struct _osdg_connection *conn;
+    unsigned int deviceTunnels = 0;
+    osdg_result_t res;
+
+    pthread_mutex_lock(&cacheLock);
+    cache_init();
+
+    for (e = bucket->head; e->next; e = e->next)
+    {
+        conn = get_hashed_connection(e);
+
+        if (memcmp(conn->serverPubkey, peerId, sizeof(osdg_key_t)))
+            continue;
+
+        if (!strncmp(conn->protocol, protocol, sizeof(conn->protocol)))
+        {
+            if (!conn->cacheEntry.refs++)
+            {
+                list_remove(&conn->cacheEntry.lruReq);
+                stats.idle--;
+            }
+
+            cache_add_user(conn, user);
+            stats.hits++;
+            pthread_mutex_unlock(&cacheLock);
+
+            *tunnel = conn;
+            return osdg_no_error;
+        }
+
+        deviceTunnels++;
+    }
+
+    stats.misses++;
+
+    /* Devices only allow a few tunnels at once, make room by dropping an idle one */
+    if (maxPerDevice && deviceTunnels >= maxPerDevice && !cache_evict_lru(peerId))
+    {
+        pthread_mutex_unlock(&cacheLock);
+        return osdg_too_many_connections;
+    }
+
+    if (maxTunnels && stats.tunnels >= maxTunnels && !cache_evict_lru(NULL))
+    {
+        pthread_mutex_unlock(&cacheLock);
+        return osdg_too_many_connections;
+    }
+
+    conn = osdg_connection_create();
+    if (!conn)
+    {
+        pthread_mutex_unlock(&cacheLock);
+        return osdg_memory_error;
+    }
+
+    /* Events are dispatched under our lock, so none is missed before we're done here */
+    osdg_set_state_change_callback(conn, cache_state_changed);
+    osdg_set_receive_data_callback(conn, cache_receive_data);
+    cache_add_user(conn, user);
+
+    res = osdg_connect_to_remote(grid, conn, peerId, protocol);
+    if (res != osdg_no_error)
+    {
+        pthread_mutex_unlock(&cacheLock);
+        osdg_connection_destroy(conn);
+        return res;
+    }
+
+    conn->cacheEntry.refs   = 1;
+    conn->cacheEntry.cached = 1;
+    conn->cacheEntry.dead   = 0;
+    list_add(bucket, &conn->cacheEntry.hashReq);
+    stats.tunnels++;
+
+    pthread_mutex_unlock(&cacheLock);
+
+    *tunnel = conn;
+    return osdg_no_error;
+}
+
+void osdg_tunnel_release(osdg_connection_t conn, struct osdg_tunnel_user *user)
+{
+    struct tunnel_cache_entry *e = &conn->cacheEntry;
+
+    pthread_mutex_lock(&cacheLock);
+
+    cache_remove_user(conn, user);
+
+    if (--e->refs == 0)
+    {
+        if (e->dead)
+        {
+            cache_destroy(conn);
+        }
+        else
+        {
+            list_add(&lru, &e->lruReq);
+            stats.idle++;
+
+            /* The limit could have been lowered */
+            if (maxTunnels && stats.tunnels > maxTunnels)
+                cache_evict_lru(NULL);
+        }
+    }
+
+    pthread_mutex_unlock(&cacheLock);
+}
+
+void tunnel_cache_connection_died(struct _osdg_connection *conn)
+{
+    pthread_mutex_lock(&cacheLock);
+
+    /* Evicted tunnels are already unlinked */
+    if (!conn->cacheEntry.dead)
+    {
+        LOG(CONNECTION, "Conn[%u] cached tunnel died", conn->connId);
+        cache_remove(conn);
+    }
+
+    if (!conn->cacheEntry.refs)
+        cache_destroy(conn);
+
+    pthread_mutex_unlock(&cacheLock);
+}
+
+void osdg_set_tunnel_cache_limits(unsigned int tunnels, unsigned int perDevice)
+{
+    pthread_mutex_lock(&cacheLock);
+    maxTunnels   = tunnels;
+    maxPerDevice = perDevice;
+    pthread_mutex_unlock(&cacheLock);
+}
+
+void osdg_get_tunnel_cache_stats(struct osdg_tunnel_cache_stats *s)
+{
+    pthread_mutex_lock(&cacheLock);
+    *s = stats;
+    pthread_mutex_unlock(&cacheLock);
+}
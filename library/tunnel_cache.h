@@ -0,0 +1,23 @@
+#ifndef INTERNAL_TUNNEL_CACHE_H
+#define INTERNAL_TUNNEL_CACHE_H
+
+#include "opensdg.h"
+#include "utils.h"
+
+/* Embedded in struct _osdg_connection */
+struct tunnel_cache_entry
+{
+    struct list_element hashReq; /* In hash bucket, while alive */
+    struct list_element lruReq;  /* In LRU list, while idle */
+    unsigned int        refs;
+    struct osdg_tunnel_user *users; /* Getting events, in the order of acquiring */
+    char                cached;  /* Owned by the tunnel cache */
+    char                dead;    /* Evicted or failed, destroyed once refs drop to 0 */
+};
+
+struct _osdg_connection;
+
+/* Called by the main loop when a cached tunnel gets closed or fails */
+void tunnel_cache_connection_died(struct _osdg_connection *conn);
+
+#endif
@@ -5,23 +5,40 @@
 
 #include "client.h"
 #include "logging.h"
+#include "pool.h"
+#include "probes.h"
+#include "profiling.h"
 #include "socket.h"
 #include "tunnel_protocol.h"
 #include "control_protocol.h"
 #include "control_protocol.pb-c.h"
 
-static inline void dump_packet(struct _osdg_connection *conn, const char *str,
+static inline void dump_packet(struct _osdg_connection *conn, enum log_event event,
                                const struct packet_header *header)
 {
     const unsigned char *buffer = (unsigned char *)header;
 
-    DUMP(PACKETS, buffer + sizeof(struct packet_header), PAYLOAD_SIZE(header),
-         "Conn[%p] %-10s %.4s", conn, str, &header->command);
+    if (!LOG_ENABLED(PACKETS))
+        return;
+
+    /* Binary record only carries the header, this is what makes it cheap */
+    if (log_record_cb)
+    {
+        _log_event(OSDG_LOG_PACKETS, event, conn->connId, header->command, PAYLOAD_SIZE(header), 0);
+    }
+    else
+    {
+        _dump(OSDG_LOG_PACKETS, buffer + sizeof(struct packet_header), PAYLOAD_SIZE(header),
+              "Conn[%p] %-10s %.4s", conn, event == LOG_EV_PACKET_SENT ? "Sending" : "Received",
+              &header->command);
+    }
 }
 
 static osdg_result_t send_packet(struct packet_header *header, struct _osdg_connection *conn)
 {
-    dump_packet(conn, "Sending", header);
+    flight_record(&conn->flightRecorder, FLIGHT_TX, header->command, PACKET_SIZE(header));
+    PROBE(packet_tx, conn->connId, header->command, PACKET_SIZE(header));
+    dump_packet(conn, LOG_EV_PACKET_SENT, header);
     return send_data((const unsigned char *)header, PACKET_SIZE(header), conn);
 }
 
@@ -50,8 +67,10 @@ static void *decryptMESG(struct packet_header *header, struct _osdg_connection *
     /* This will overwrite header and nonce */
     zero_outer_pad(mesg->mesg_payload);
     /* We don't want to bother with malloc(), decrypt in place */
+    PROF_START(t);
     res = crypto_box_open_afternm(payload, payload, length + crypto_box_BOXZEROBYTES,
         nonce.data, client->beforenmData);
+    PROF_END(decrypt, t);
     if (res)
     {
         client->errorKind = osdg_decryption_error;
@@ -89,7 +108,7 @@ int handle_packet(struct _osdg_connection *client) {
     if (client->receiveBuffer[2] == MSG_FORWARD_REPLY) {
         struct DataPacket *pkt = (struct DataPacket *)client->receiveBuffer;
         unsigned int length = SWAP_16(pkt->size) - 1;
-        ForwardReply *reply = forward_reply__unpack(NULL, length, &pkt->data[1]);
+        ForwardReply *reply = forward_reply__unpack(PB_ALLOCATOR, length, &pkt->data[1]);
 
         if (! reply) {
             DUMP(ERRORS, pkt->data, length, "Failed to decode MSG_FORWARD_REPLY");
@@ -102,12 +121,23 @@ int handle_packet(struct _osdg_connection *client) {
             LOG(ERRORS, "Wrong forwarding signature: %s", reply->signature);
 		}
 
-        forward_reply__free_unpacked(reply, NULL);
+        forward_reply__free_unpacked(reply, PB_ALLOCATOR);
 
         if (ret) {
             return -1;
 		}
 
+        if (! client->forwardPending) {
+            LOG(ERRORS, "Conn[%p] unexpected MSG_FORWARD_REPLY; ignoring", client);
+            return 0;
+        }
+        client->forwardPending = 0;
+
+        /* In pipelined mode TELL has already been sent together with MSG_FORWARD_REMOTE */
+        if (client->pipelineForward) {
+            return 0;
+        }
+
         return sendTELL(client);
     }
 
@@ -117,7 +147,7 @@ int handle_packet(struct _osdg_connection *client) {
     if (client->receiveBuffer[2] == MSG_FORWARD_ERROR) {
         struct DataPacket *pkt = (struct DataPacket *)client->receiveBuffer;
         unsigned int length = SWAP_16(pkt->size) - 1;
-        ForwardError *reply = forward_error__unpack(NULL, length, &pkt->data[1]);
+        ForwardError *reply = forward_error__unpack(PB_ALLOCATOR, length, &pkt->data[1]);
 
         if (! reply) {
             DUMP(ERRORS, pkt->data, length, "Failed to decode MSG_FORWARD_ERROR");
@@ -140,7 +170,7 @@ int handle_packet(struct _osdg_connection *client) {
             break;
         }
 
-        forward_error__free_unpacked(reply, NULL);
+        forward_error__free_unpacked(reply, PB_ALLOCATOR);
         return -1;
     }
 
@@ -157,7 +187,7 @@ int handle_packet(struct _osdg_connection *client) {
         return -1;
     }
 
-    dump_packet(client, "Received", header);
+    dump_packet(client, LOG_EV_PACKET_RECEIVED, header);
 
     if (header->command == CMD_WELC) {
         struct packetWELC *welc = (struct packetWELC *)header;
@@ -165,6 +195,7 @@ int handle_packet(struct _osdg_connection *client) {
         union curvecp_nonce nonce;
         unsigned char zeroMsg[sizeof(helo.ciphertext) + crypto_box_BOXZEROBYTES];
 
+        PROBE(handshake_welc, client->connId);
         memcpy(client->serverPubkey, welc->serverKey, sizeof(welc->serverKey));
         DUMP(PROTOCOL, client->serverPubkey, sizeof(client->serverPubkey), "Received server public key");
         crypto_box_keypair(client->clientTempPubkey, client->clientTempSecret);
@@ -202,6 +233,7 @@ int handle_packet(struct _osdg_connection *client) {
         struct packetVOCH *voch;
         int certDataSize;
 
+        PROBE(handshake_cook, client->connId);
         build_long_term_nonce(&nonce, "CurveCPK", cook->nonce);
 
         /* Replace nonce with padding zeroes in place and decrypt the message */
@@ -227,6 +259,11 @@ int handle_packet(struct _osdg_connection *client) {
          * build and encrypt the packet in place
          */
         voch = client_get_buffer(client);
+        if (!voch) {
+            client->errorKind = osdg_memory_error;
+            return -1;
+        }
+
         outerData = (struct curvecp_vouch_outer *)(voch->curvecp_vouch_outer - crypto_box_BOXZEROBYTES);
 
         /* Build the inner crypto box */
@@ -304,6 +341,8 @@ int handle_packet(struct _osdg_connection *client) {
             return -1;
 		}
 
+        PROBE(handshake_redy, client->connId, client->mode);
+
         /*
          * REDY payload from DEVISmart cloud is empty, but a thermostat sends its
          * built-in license certificate here.
@@ -344,7 +383,7 @@ int handle_packet(struct _osdg_connection *client) {
         result = connection_handle_data(client, payload->data.data, length);
 
     } else {
-        LOG(ERRORS, "Unknown packet received; ignoring");
+        LOG_RATELIMITED(ERRORS, "Conn[%p] Unknown packet received; ignoring", client);
         return 0;
     }
 
@@ -352,35 +391,77 @@ int handle_packet(struct _osdg_connection *client) {
 }
 
 
+static inline void record_received_packet(struct _osdg_connection *client)
+{
+    const struct packet_header *header = (struct packet_header *)client->receiveBuffer;
+    unsigned int command;
+
+    /* Forwarder messages have no CurveCP header, just a type byte */
+    if (client->bytesReceived >= sizeof(struct packet_header) && header->magic == PACKET_MAGIC)
+        command = header->command;
+    else
+        command = client->receiveBuffer[2];
+
+    flight_record(&client->flightRecorder, FLIGHT_RX, command, client->bytesReceived);
+    PROBE(packet_rx, client->connId, command, client->bytesReceived);
+}
+
 int receive_packet(struct _osdg_connection *client) {
 	int bytesReceived;		// client->bytesReceived or 0 (need more data) or -1 (recv error)
 
+	int ret;
+
 	// Every packet is prefixed with length, read it first
 	if (client->bytesLeft == 0) {
 		client->bytesReceived	= 0;
-		client->bytesLeft		= sizeof(unsigned short);
+		client->bytesLeft		= sizeof(client->sizePrefix);
 	}
 
-	bytesReceived = receive_data(client);
-	if (bytesReceived == sizeof(unsigned short)) {
+	// The length is staged in the connection itself, a buffer is only taken for the packet body
+	if (!client->receiveBuffer) {
+		unsigned int size;
+
+		bytesReceived = receive_data(client, client->sizePrefix);
+		if (bytesReceived <= 0) {
+			return bytesReceived;
+		}
+
 		/* Data size is bigendian */
-		unsigned int size = (client->receiveBuffer[0] << 8) | client->receiveBuffer[1];
-		if (size + sizeof(unsigned short) > client->bufferSize) {
+		size = (client->sizePrefix[0] << 8) | client->sizePrefix[1];
+		if (size + sizeof(client->sizePrefix) > client->bufferSize) {
 			LOG(ERRORS, "Buffer size of %u exceeded; incoming packet size is %u", client->bufferSize, size);
 			client->errorKind = osdg_buffer_exceeded;
 			return -1;
 		}
 
+		client->receiveBuffer = client_get_buffer(client);
+		if (!client->receiveBuffer) {
+			client->errorKind = osdg_memory_error;
+			return -1;
+		}
+
+		memcpy(client->receiveBuffer, client->sizePrefix, sizeof(client->sizePrefix));
 		client->bytesLeft = size;
-		bytesReceived = receive_data(client);
 	}
 
+	bytesReceived = receive_data(client, client->receiveBuffer);
 	if (bytesReceived <= 0) {
 		return bytesReceived;
+	}
 
-	} else {
-		return handle_packet(client);
+	record_received_packet(client);
+
+	PROF_START(t);
+	ret = handle_packet(client);
+	PROF_END(frame, t);
+
+	/* The packet has been dispatched, give the buffer back. Shutdown could have done it already. */
+	if (client->receiveBuffer) {
+		client_put_buffer(client, client->receiveBuffer);
+		client->receiveBuffer = NULL;
 	}
+
+	return ret;
 }
 
 
@@ -390,7 +471,7 @@ osdg_result_t sendMESG(struct _osdg_connection *client, unsigned char dataType,
 	struct mesg_payload *payload;
 
 	if (!mesg)
-		return osdg_buffer_exceeded;
+		return client->errorKind;
 
 	payload = (struct mesg_payload *)(mesg->mesg_payload - crypto_box_BOXZEROBYTES);
 
@@ -416,6 +497,12 @@ struct packetMESG *get_MESG_packet(struct _osdg_connection *client, size_t dataS
 
     /* We will build and encrypt the box in place, so need only one buffer */
     mesg = client_get_buffer(client);
+    if (!mesg)
+    {
+        client->errorKind = osdg_memory_error;
+        return NULL;
+    }
+
     payload = (struct mesg_payload *)(mesg->mesg_payload - crypto_box_BOXZEROBYTES);
     payload->data.size = SWAP_16(dataSize);
 
@@ -434,9 +521,11 @@ osdg_result_t send_MESG_packet(struct _osdg_connection *conn, struct packetMESG
     zero_pad(payload->outerPad);
 
     build_short_term_nonce(&nonce, "CurveCP-client-M", client_get_nonce(conn));
+    PROF_START(t);
     res = crypto_box_afternm((unsigned char *)payload, (unsigned char *)payload,
         sizeof(struct mesg_payload) + dataSize,
         nonce.data, conn->beforenmData);
+    PROF_END(encrypt, t);
     if (res)
     {
         result = osdg_crypto_core_error;
@@ -459,6 +548,12 @@ static int sendForward(struct _osdg_connection *conn)
     size_t dataSize;
     osdg_result_t result;
 
+    if (!pkt)
+    {
+        conn->errorKind = osdg_memory_error;
+        return -1;
+    }
+
     fwd.magic         = FORWARD_REMOTE_MAGIC;
     fwd.protocolmajor = PROTOCOL_VERSION_MAJOR;
     fwd.protocolminor = PROTOCOL_VERSION_MINOR;
@@ -473,13 +568,34 @@ static int sendForward(struct _osdg_connection *conn)
     forward_remote__pack(&fwd, &pkt->data[1]);
 
     /* We don't need this any more */
-    free(conn->tunnelId);
+    client_put_buffer(conn, conn->tunnelId);
     conn->tunnelId = NULL;
 
     /* MSG_FORWARD_REMOTE is sent unencrypted */
     DUMP(PROTOCOL, pkt->data, dataSize, "sendForward(): Sending MSG_FORWARD_REMOTE");
+    flight_record(&conn->flightRecorder, FLIGHT_TX, MSG_FORWARD_REMOTE, sizeof(struct DataPacket) + (unsigned int)dataSize);
+    PROBE(packet_tx, conn->connId, MSG_FORWARD_REMOTE, sizeof(struct DataPacket) + (unsigned int)dataSize);
     result = send_data((unsigned char *)pkt, sizeof(struct DataPacket) + (int)dataSize, conn);
-    return connection_set_result(conn, result);
+    client_put_buffer(conn, pkt);
+
+    if (result != osdg_no_error)
+        return connection_set_result(conn, result);
+
+    conn->forwardPending = 1;
+
+    /*
+     * The forwarder holds on to whatever follows MSG_FORWARD_REMOTE until the
+     * tunnel is attached, so TELL can go out right away. MSG_FORWARD_HOLD and
+     * MSG_FORWARD_ERROR are still handled by handle_packet() as usual; in the
+     * latter case the TELL is simply dropped together with the socket.
+     */
+    if (conn->pipelineForward)
+    {
+        LOG(PROTOCOL, "sendForward(): Pipelining TELL");
+        return sendTELL(conn);
+    }
+
+    return 0;
 }
 
 int start_connection(struct _osdg_connection *conn)
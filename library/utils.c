@@ -1,8 +1,10 @@
 #include <sodium.h>
 
+#include "completion.h"
 #include "logging.h"
 #include "mainloop.h"
 #include "opensdg.h"
+#include "pool.h"
 #include "utils.h"
 #include "version.h"
 
@@ -16,20 +18,30 @@ osdg_result_t osdg_init(void)
         return osdg_crypto_core_error;
     }
 
+    pool_init();
     mainloop_events_init();
 
-    res = mainloop_init();
+    res = completion_init();
     if (!res)
-        return osdg_no_error;
+    {
+        res = mainloop_init();
+        if (!res)
+            return osdg_no_error;
+
+        completion_shutdown();
+    }
 
     mainloop_events_shutdown();
+    pool_shutdown();
     return osdg_system_error;
 }
 
 void osdg_shutdown(void)
 {
     mainloop_shutdown();
+    completion_shutdown();
     mainloop_events_shutdown();
+    pool_shutdown();
 }
 
 void osdg_create_private_key(osdg_key_t key)
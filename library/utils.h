@@ -77,6 +77,14 @@ static inline void list_add(struct list *l, struct list_element *e)
     l->tail = e;
 }
 
+static inline void list_insert_before(struct list_element *e, struct list_element *before)
+{
+    e->prev = before->prev;
+    e->next = before;
+    before->prev->next = e;
+    before->prev = e;
+}
+
 static inline void list_remove(struct list_element *e)
 {
     e->prev->next = e->next;
@@ -106,4 +114,12 @@ static timestamp_t timestamp(void)
     return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+static inline timestamp_t timestamp_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 #endif
@@ -0,0 +1,180 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config_cache.h"
+
+#define MAX_HOUSES 16
+
+static struct house_config *houses[MAX_HOUSES];
+/* Configuration arrives on the library's thread, lookups come from the console */
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* FNV-1a, 64 bits */
+unsigned long long config_hash(const void *data, unsigned int size)
+{
+    const unsigned char *p = data;
+    unsigned long long h = 0xcbf29ce484222325ULL;
+
+    while (size--)
+    {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+struct house_config *config_cache_alloc(unsigned int numRooms)
+{
+    struct house_config *cfg = calloc(1, sizeof(struct house_config) + numRooms * sizeof(struct room_config));
+
+    if (cfg)
+    {
+        cfg->refs     = 1;
+        cfg->numRooms = numRooms;
+    }
+
+    return cfg;
+}
+
+static void config_put(struct house_config *cfg)
+{
+    if (!--cfg->refs)
+        free(cfg);
+}
+
+static struct house_config *cache_lookup(const osdg_key_t peerId, size_t keyOffset, unsigned int maxAge)
+{
+    struct house_config *ret = NULL;
+    time_t now = time(NULL);
+    unsigned int i;
+
+    pthread_mutex_lock(&cacheLock);
+
+    for (i = 0; i < MAX_HOUSES; i++)
+    {
+        struct house_config *cfg = houses[i];
+
+        if (cfg && !memcmp((char *)cfg + keyOffset, peerId, sizeof(osdg_key_t)))
+        {
+            if (now - cfg->fetched <= maxAge)
+            {
+                cfg->refs++;
+                ret = cfg;
+            }
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&cacheLock);
+    return ret;
+}
+
+struct house_config *config_cache_lookup(const osdg_key_t housePeerId, unsigned int maxAge)
+{
+    return cache_lookup(housePeerId, offsetof(struct house_config, housePeerId), maxAge);
+}
+
+struct house_config *config_cache_lookup_source(const osdg_key_t sourcePeerId, unsigned int maxAge)
+{
+    return cache_lookup(sourcePeerId, offsetof(struct house_config, sourcePeerId), maxAge);
+}
+
+struct house_config *config_cache_find(unsigned long long hash)
+{
+    struct house_config *ret = NULL;
+    unsigned int i;
+
+    pthread_mutex_lock(&cacheLock);
+
+    for (i = 0; i < MAX_HOUSES; i++)
+    {
+        if (houses[i] && houses[i]->hash == hash)
+        {
+            ret = houses[i];
+            ret->refs++;
+            ret->fetched = time(NULL);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&cacheLock);
+    return ret;
+}
+
+void config_cache_insert(struct house_config *cfg)
+{
+    unsigned int i, slot = MAX_HOUSES, oldest = 0;
+
+    cfg->fetched = time(NULL);
+
+    pthread_mutex_lock(&cacheLock);
+
+    for (i = 0; i < MAX_HOUSES; i++)
+    {
+        if (!houses[i])
+        {
+            if (slot == MAX_HOUSES)
+                slot = i;
+        }
+        else if (!memcmp(houses[i]->housePeerId, cfg->housePeerId, sizeof(osdg_key_t)))
+        {
+            slot = i;
+            break;
+        }
+        else if (!houses[oldest] || houses[i]->fetched < houses[oldest]->fetched)
+        {
+            oldest = i;
+        }
+    }
+
+    /* Full, evict the stalest house */
+    if (slot == MAX_HOUSES)
+        slot = oldest;
+
+    if (houses[slot])
+        config_put(houses[slot]);
+
+    cfg->refs++;
+    houses[slot] = cfg;
+
+    pthread_mutex_unlock(&cacheLock);
+}
+
+int config_cache_find_room(const char *houseName, const char *roomName, struct room_config *room)
+{
+    unsigned int i, j;
+    int ret = -1;
+
+    pthread_mutex_lock(&cacheLock);
+
+    for (i = 0; i < MAX_HOUSES && ret; i++)
+    {
+        struct house_config *cfg = houses[i];
+
+        if (!cfg || strcmp(cfg->houseName, houseName))
+            continue;
+
+        for (j = 0; j < cfg->numRooms; j++)
+        {
+            if (!strcmp(cfg->rooms[j].name, roomName))
+            {
+                *room = cfg->rooms[j];
+                ret = 0;
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&cacheLock);
+    return ret;
+}
+
+void config_cache_release(struct house_config *cfg)
+{
+    pthread_mutex_lock(&cacheLock);
+    config_put(cfg);
+    pthread_mutex_unlock(&cacheLock);
+}
@@ -0,0 +1,50 @@
+#ifndef _CONFIG_CACHE_H
+#define _CONFIG_CACHE_H
+
+#include <time.h>
+
+#include "opensdg.h"
+
+/*
+ * Cache of parsed house configurations, downloaded via dominion-configuration-1.0.
+ * Entries are keyed by housePeerId; the raw JSON content hash allows to skip
+ * reparsing when the same data is downloaded again. Parsed structures are shared
+ * and reference counted, every lookup must be paired with config_cache_release().
+ */
+struct room_config
+{
+    char name[64];
+    char zone[32];
+    int  sortOrder;
+};
+
+struct house_config
+{
+    unsigned int       refs;
+    unsigned long long hash;     /* Of the raw JSON */
+    time_t             fetched;  /* When the content has been seen last time */
+    osdg_key_t         housePeerId;
+    osdg_key_t         sourcePeerId; /* Where it has been downloaded from */
+    char               houseName[64];
+    unsigned int       numRooms;
+    struct room_config rooms[];
+};
+
+/* House configuration is downloaded only on pairing, it doesn't change often */
+#define CONFIG_MAX_AGE (24 * 60 * 60)
+
+unsigned long long config_hash(const void *data, unsigned int size);
+struct house_config *config_cache_alloc(unsigned int numRooms);
+/* Configuration of the given house, if it's not older than maxAge seconds */
+struct house_config *config_cache_lookup(const osdg_key_t housePeerId, unsigned int maxAge);
+/* Same, but by the peer, which has given us the configuration */
+struct house_config *config_cache_lookup_source(const osdg_key_t sourcePeerId, unsigned int maxAge);
+/* Configuration with the given content hash, if already known; marks it fresh */
+struct house_config *config_cache_find(unsigned long long hash);
+/* Adds a new configuration, replacing the old one for the same house */
+void config_cache_insert(struct house_config *cfg);
+/* Copies out the room of the house with the given name; returns -1 if not known */
+int config_cache_find_room(const char *houseName, const char *roomName, struct room_config *room);
+void config_cache_release(struct house_config *cfg);
+
+#endif
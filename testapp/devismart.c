@@ -8,6 +8,8 @@
 #include "testapp.h"
 #include "devismart.h"
 #include "devismart_protocol.h"
+#include "fleet.h"
+#include "schedule.h"
 
 #define ENUM_TO_STR(x) case x: return #x;
 #define STR_TO_ENUM(x) if (!strcmp(str, #x)) return x;
@@ -876,6 +878,14 @@ static int handle_single_packet(const uint8_t *data, uint32_t size)
   return packetSize;
 }
 
+/* Ends a rate-limited message, which is followed by a dump */
+static void print_suppressed(int suppressed)
+{
+    if (suppressed)
+        printf(" (%d similar suppressed)", suppressed);
+    printf(":\n");
+}
+
 osdg_result_t devismart_receive_data(osdg_connection_t conn, const void *ptr, unsigned int size)
 {
     const uint8_t *data = ptr;
@@ -888,41 +898,60 @@ osdg_result_t devismart_receive_data(osdg_connection_t conn, const void *ptr, un
      * to be done at any moment. Also this suggests that garbage zero byte
      * in the beginning of this bunch could be a buffering bug.
      */
+    /* A misbehaving device can hit these on every packet, don't let it flood the console */
+    static struct osdg_log_ratelimit malformedLimit, leftoverLimit;
+    int suppressed;
+
     while (size >= sizeof(struct MsgHeader))
     {
         int handled = handle_single_packet(data, size);
 
 	if (handled == -1)
 	{
-	  printf("Malformed stream at position %d; size exceeds maximum:\n", (int)(data - start));
-          dump_data(start, origSize);
+	  suppressed = osdg_log_ratelimit(&malformedLimit);
+	  if (suppressed >= 0)
+	  {
+	    printf("Malformed stream at position %d; size exceeds maximum", (int)(data - start));
+	    print_suppressed(suppressed);
+	    dump_data(start, origSize);
+	  }
 	  return osdg_no_error; /* Do not break the connection */
 	}
 
+	/* Remember the current schedule, so that we only send what changes, and where the device is */
+	schedule_store(osdg_get_peer_id(conn), ((const struct MsgHeader *)data)->msgCode,
+	               data + sizeof(struct MsgHeader), handled - sizeof(struct MsgHeader));
+	fleet_store(osdg_get_peer_id(conn), ((const struct MsgHeader *)data)->msgCode,
+	            data + sizeof(struct MsgHeader), handled - sizeof(struct MsgHeader));
+
 	size -= handled;
 	data += handled;
     }
 
     if (size)
     {
-        printf("Leftover fragment; size %d:\n", size);
-        dump_data(data, size);
+        suppressed = osdg_log_ratelimit(&leftoverLimit);
+        if (suppressed >= 0)
+        {
+            printf("Leftover fragment; size %d", size);
+            print_suppressed(suppressed);
+            dump_data(data, size);
+        }
     }
 
     return osdg_no_error;
 }
 
-osdg_result_t devismart_send(osdg_connection_t conn, char *argStr)
+unsigned int devismart_build_packet(void *buffer, char *argStr)
 {
     const char *cmdStr = getWord(&argStr);
     int msgCode = findCode(cmdStr);
-    unsigned char buffer[sizeof(struct SendMsgHeader) + 255]; /* Payload size is one byte, so maximum of 255 */
-    struct SendMsgHeader *packet = (struct SendMsgHeader *)&buffer;
+    struct SendMsgHeader *packet = buffer;
 
     if (msgCode == -1)
     {
         printf("Unknown message code %s\n", cmdStr);
-        return osdg_no_error;
+        return 0;
     }
 
     packet->noPayload = (*argStr) ? 0 : 1;
@@ -953,7 +982,7 @@ osdg_result_t devismart_send(osdg_connection_t conn, char *argStr)
         if (!packet->header.dataSize)
         {
             printf("Unsupported message code %s\n", cmdStr);
-            return osdg_no_error;
+            return 0;
         }
 
         payloadVal = strtoul(getWord(&argStr), NULL, 0);
@@ -977,5 +1006,13 @@ osdg_result_t devismart_send(osdg_connection_t conn, char *argStr)
         packet->header.dataSize = 0;
     }
 
-    return osdg_send_data(conn, packet, sizeof(struct SendMsgHeader) + packet->header.dataSize);
+    return sizeof(struct SendMsgHeader) + packet->header.dataSize;
+}
+
+osdg_result_t devismart_send(osdg_connection_t conn, char *argStr)
+{
+    unsigned char buffer[DEVISMART_MAX_PACKET];
+    unsigned int size = devismart_build_packet(buffer, argStr);
+
+    return size ? osdg_send_data(conn, buffer, size) : osdg_no_error;
 }
@@ -3,4 +3,9 @@
 int devismart_config_connect(osdg_connection_t conn);
 
 osdg_result_t devismart_receive_data(osdg_connection_t conn, const void *data, unsigned int size);
+/* struct SendMsgHeader plus payload; payload size is one byte, so maximum of 255 */
+#define DEVISMART_MAX_PACKET (5 + 255)
+
+/* Returns packet size, 0 on error */
+unsigned int devismart_build_packet(void *buffer, char *argStr);
 osdg_result_t devismart_send(osdg_connection_t conn, char *argStr);
@@ -4,11 +4,13 @@
 #include <stdbool.h>
 
 #include "opensdg.h"
+#include "config_cache.h"
+#include "fleet.h"
 #include "jsmn.h"
 #include "devismart.h"
 #include "testapp.h"
 
-static bool jsoneq(const char *json, jsmntok_t *tok, const char *s)
+static bool jsoneq(const char *json, const jsmntok_t *tok, const char *s)
 {
 	bool isStringType	= (tok->type == JSMN_STRING);
 	bool isSameLength	= ((int) strlen(s) == tok->end - tok->start);
@@ -57,7 +59,45 @@ struct ConfigDataHeader
   unsigned int length; /* Total length of the following data */
 };
 
-static int parse_config_data(const char *json, int size)
+/* Copies a string token, truncating it if needed */
+static void copy_token(char *dst, size_t len, const char *json, const jsmntok_t *tok)
+{
+    size_t n = tok->end - tok->start;
+
+    if (n >= len)
+        n = len - 1;
+
+    memcpy(dst, json + tok->start, n);
+    dst[n] = 0;
+}
+
+/* Index of the token, following the given one together with all its children */
+static int skip_token(const jsmntok_t *t, int i)
+{
+    int pending = 1;
+
+    while (pending--)
+        pending += t[i++].size;
+
+    return i;
+}
+
+static void parse_room(struct room_config *room, const char *json, const jsmntok_t *t, int i)
+{
+    int n = t[i].size;
+
+    for (i++; n--; i = skip_token(t, i + 1))
+    {
+        if (jsoneq(json, &t[i], "roomName"))
+            copy_token(room->name, sizeof(room->name), json, &t[i + 1]);
+        else if (jsoneq(json, &t[i], "zone"))
+            copy_token(room->zone, sizeof(room->zone), json, &t[i + 1]);
+        else if (jsoneq(json, &t[i], "sortOrder"))
+            room->sortOrder = atoi(json + t[i + 1].start);
+    }
+}
+
+static struct house_config *parse_config_data(const char *json, int size)
 {
     // Received data is a JSON and it looks like this:
 	/* {
@@ -78,57 +118,81 @@ static int parse_config_data(const char *json, int size)
 
     jsmn_parser p;
     jsmntok_t t[1024];
-    int r, i, j, k;
+    struct house_config *cfg;
+    int r, i, rooms = -1;
+    char housePeer[AS_HEX(sizeof(osdg_key_t))] = "";
 
     jsmn_init(&p);
     r = jsmn_parse(&p, json, size, t, sizeof(t) / sizeof(t[0]));
 
-    if (r < 0) {
+    if (r < 1 || t[0].type != JSMN_OBJECT) {
         printf("Failed to parse configuration JSON: %d\n", r);
-        return -1;
+        return NULL;
     }
 
-	char *housePeer = NULL;
-	char *houseName = NULL;
-	for (i = 1; i < r; i++) {
-		jsmntok_t*	tok = &t[i + 1];
-		int			len = tok->end - tok->start;
+    /* Rooms count is needed before allocating */
+    for (i = 1; i < r; i = skip_token(t, i + 1)) {
+        if (jsoneq(json, &t[i], "rooms") && t[i + 1].type == JSMN_ARRAY) {
+            rooms = i + 1;
+            break;
+        }
+    }
+
+    cfg = config_cache_alloc(rooms == -1 ? 0 : t[rooms].size);
+    if (!cfg) {
+        printf("Failed to allocate configuration\n");
+        return NULL;
+    }
+
+	for (i = 1; i < r; i = skip_token(t, i + 1)) {
 		if (jsoneq(json, &t[i], "housePeerId")) {
-			housePeer = malloc(len + 1);
-			if (housePeer) {
-				memcpy(housePeer, json + tok->start, len);
-				housePeer[len] = 0;
-			}
+			copy_token(housePeer, sizeof(housePeer), json, &t[i + 1]);
 
 		} else if (jsoneq(json, &t[i], "houseName")) {
-			houseName = malloc(len + 1);
-			if (houseName) {
-				memcpy(houseName, json + tok->start, len);
-				houseName[len] = 0;
+			copy_token(cfg->houseName, sizeof(cfg->houseName), json, &t[i + 1]);
+
+		} else if (i + 1 == rooms) {
+			unsigned int n;
+			int j = rooms + 1;
+
+			for (n = 0; n < cfg->numRooms; n++, j = skip_token(t, j)) {
+				if (t[j].type == JSMN_OBJECT)
+					parse_room(&cfg->rooms[n], json, t, j);
 			}
 		}
     }
 
-	if (housePeer != NULL && houseName != NULL) {
-		osdg_key_t housePeerId;
-		if (! osdg_hex_to_bin(housePeerId, sizeof(housePeerId), housePeer, sizeof(osdg_key_t) * 2, NULL, NULL, NULL)) {
-			add_pairing(housePeerId, houseName);
-		} else {
-			if (houseName == NULL) {
-				houseName = "";
-			}
-			printf("Malformed room %s peer ID: %s\n", houseName, housePeer);
-		}
+	if (osdg_hex_to_bin(cfg->housePeerId, sizeof(cfg->housePeerId), housePeer, sizeof(osdg_key_t) * 2, NULL, NULL, NULL)) {
+		printf("Malformed house %s peer ID: %s\n", cfg->houseName, housePeer);
+		config_cache_release(cfg);
+		return NULL;
 	}
 
-	if (housePeer != NULL) {
-		free(housePeer);
-	}
-	if (houseName != NULL) {
-		free(houseName);
-	}
+	return cfg;
+}
 
-	return 0;
+/* Identical content is not parsed again, the cached copy is reused */
+static int handle_config_data(const unsigned char *sourcePeerId, const char *json, int size)
+{
+    unsigned long long hash = config_hash(json, size);
+    struct house_config *cfg = config_cache_find(hash);
+
+    if (cfg) {
+        printf("Configuration of house %s is unchanged\n", cfg->houseName);
+    } else {
+        cfg = parse_config_data(json, size);
+        if (!cfg)
+            return -1;
+
+        cfg->hash = hash;
+        memcpy(cfg->sourcePeerId, sourcePeerId, sizeof(cfg->sourcePeerId));
+        config_cache_insert(cfg);
+    }
+
+    add_pairing(cfg->housePeerId, cfg->houseName);
+    fleet_apply_config(cfg);
+    config_cache_release(cfg);
+    return 0;
 }
 
 struct ChunkedData
@@ -176,13 +240,13 @@ static osdg_result_t devismart_receive_config_data(osdg_connection_t conn, const
       if (cd->received < cd->length)
           return osdg_no_error; // Need more data
 
-      res = parse_config_data(cd->json, cd->length);
+      res = handle_config_data(osdg_get_peer_id(conn), cd->json, cd->length);
       osdg_set_user_data(conn, NULL);
       free(cd);
   }
   else
   {
-      res = parse_config_data(data, size);
+      res = handle_config_data(osdg_get_peer_id(conn), data, size);
   }
 
   if (!res)
@@ -214,6 +278,17 @@ static void devismart_config_status_changed(osdg_connection_t conn, enum osdg_co
 int devismart_config_connect(osdg_connection_t conn)
 {
     const unsigned char *peerId = osdg_get_peer_id(conn);
+    struct house_config *cfg = config_cache_lookup_source(peerId, CONFIG_MAX_AGE);
+
+    /* Fresh enough, no need for another tunnel and chunked transfer */
+    if (cfg) {
+        printf("Using cached configuration of house %s\n", cfg->houseName);
+        add_pairing(cfg->housePeerId, cfg->houseName);
+        fleet_apply_config(cfg);
+        config_cache_release(cfg);
+        osdg_connection_destroy(conn);
+        return 0;
+    }
 
     osdg_set_state_change_callback(conn, devismart_config_status_changed);
     osdg_set_receive_data_callback(conn, devismart_receive_config_data);
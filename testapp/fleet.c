@@ -0,0 +1,296 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "devismart_protocol.h"
+#include "fleet.h"
+
+#define FLEET_BUCKETS 256 /* Power of 2 */
+
+struct fleet_group
+{
+    struct fleet_group *hashNext;
+    unsigned long long  hash;
+    enum fleet_key      key;
+    char                house[64];
+    char                name[64];  /* Empty for FLEET_HOUSE */
+    struct fleet_peer  *first;
+    unsigned int        count;
+};
+
+static struct fleet_peer  *peers[FLEET_BUCKETS];
+static struct fleet_group *groups[FLEET_BUCKETS];
+/* Names arrive on the library's thread, queries come from the console */
+static pthread_mutex_t fleetLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Peer IDs are public keys, any part of them is random enough */
+static inline unsigned int peer_bucket(const osdg_key_t peerId)
+{
+    return (peerId[0] | (peerId[1] << 8)) & (FLEET_BUCKETS - 1);
+}
+
+static unsigned long long group_hash(enum fleet_key key, const char *house, const char *name)
+{
+    return (config_hash(house, strlen(house)) * 31 + config_hash(name, strlen(name))) ^ key;
+}
+
+static char *peer_name(struct fleet_peer *peer, enum fleet_key key, size_t *size)
+{
+    switch (key)
+    {
+    case FLEET_HOUSE:
+        *size = sizeof(peer->house);
+        return peer->house;
+    case FLEET_ZONE:
+        *size = sizeof(peer->zone);
+        return peer->zone;
+    default:
+        *size = sizeof(peer->room);
+        return peer->room;
+    }
+}
+
+static struct fleet_group *find_group(enum fleet_key key, const char *house, const char *name, int create)
+{
+    unsigned long long hash = group_hash(key, house, name);
+    struct fleet_group **bucket = &groups[hash & (FLEET_BUCKETS - 1)];
+    struct fleet_group *g;
+
+    for (g = *bucket; g; g = g->hashNext)
+    {
+        if (g->hash == hash && g->key == key && !strcmp(g->house, house) && !strcmp(g->name, name))
+            return g;
+    }
+
+    if (!create)
+        return NULL;
+
+    g = calloc(1, sizeof(struct fleet_group));
+    if (!g)
+        return NULL;
+
+    g->hash = hash;
+    g->key  = key;
+    strncpy(g->house, house, sizeof(g->house) - 1);
+    strncpy(g->name, name, sizeof(g->name) - 1);
+    g->hashNext = *bucket;
+    *bucket = g;
+
+    return g;
+}
+
+static void free_group(struct fleet_group *group)
+{
+    struct fleet_group **g;
+
+    for (g = &groups[group->hash & (FLEET_BUCKETS - 1)]; *g; g = &(*g)->hashNext)
+    {
+        if (*g == group)
+        {
+            *g = group->hashNext;
+            break;
+        }
+    }
+
+    free(group);
+}
+
+static void link_peer(struct fleet_peer *peer, enum fleet_key key)
+{
+    struct fleet_link *l = &peer->link[key];
+    const char *name = key == FLEET_HOUSE ? "" : (key == FLEET_ZONE ? peer->zone : peer->room);
+    struct fleet_group *g;
+
+    /* Zones and rooms don't mean anything without a house */
+    if (!peer->house[0] || (key != FLEET_HOUSE && !name[0]))
+        return;
+
+    g = find_group(key, peer->house, name, 1);
+    if (!g)
+        return;
+
+    l->group = g;
+    l->prev  = NULL;
+    l->next  = g->first;
+    if (g->first)
+        g->first->link[key].prev = peer;
+    g->first = peer;
+    g->count++;
+}
+
+static void unlink_peer(struct fleet_peer *peer, enum fleet_key key)
+{
+    struct fleet_link *l = &peer->link[key];
+    struct fleet_group *g = l->group;
+
+    if (!g)
+        return;
+
+    if (l->prev)
+        l->prev->link[key].next = l->next;
+    else
+        g->first = l->next;
+    if (l->next)
+        l->next->link[key].prev = l->prev;
+
+    l->group = NULL;
+    if (!--g->count)
+        free_group(g);
+}
+
+static void set_name(struct fleet_peer *peer, enum fleet_key key, const char *name)
+{
+    size_t size;
+    char *field = peer_name(peer, key, &size);
+    unsigned int k, last;
+
+    if (!strcmp(field, name))
+        return;
+
+    /* Zones and rooms belong to the house, so the house moves all of them */
+    last = key == FLEET_HOUSE ? FLEET_KEYS - 1 : key;
+
+    for (k = key; k <= last; k++)
+        unlink_peer(peer, k);
+
+    strncpy(field, name, size - 1);
+    field[size - 1] = 0;
+
+    for (k = key; k <= last; k++)
+        link_peer(peer, k);
+}
+
+static struct fleet_peer *find_peer(const osdg_key_t peerId, int create)
+{
+    struct fleet_peer **bucket = &peers[peer_bucket(peerId)];
+    struct fleet_peer *peer;
+
+    for (peer = *bucket; peer; peer = peer->hashNext)
+    {
+        if (!memcmp(peer->peerId, peerId, sizeof(osdg_key_t)))
+            return peer;
+    }
+
+    if (!create)
+        return NULL;
+
+    peer = calloc(1, sizeof(struct fleet_peer));
+    if (!peer)
+        return NULL;
+
+    memcpy(peer->peerId, peerId, sizeof(osdg_key_t));
+    peer->hashNext = *bucket;
+    *bucket = peer;
+
+    return peer;
+}
+
+static void apply_room(struct fleet_peer *peer, const struct room_config *room)
+{
+    if (!peer->zoneReported)
+        set_name(peer, FLEET_ZONE, room->zone);
+    peer->sortOrder = room->sortOrder;
+}
+
+void fleet_store(const osdg_key_t peerId, unsigned short msgCode, const unsigned char *payload, unsigned int size)
+{
+    struct fleet_peer *peer;
+    struct room_config room;
+    char name[64];
+    unsigned int len;
+
+    if (msgCode != SYSTEM_HOUSE_NAME && msgCode != SYSTEM_ZONE_NAME && msgCode != SYSTEM_ROOM_NAME)
+        return;
+
+    /* Payload is Pascal string */
+    if (!size || payload[0] + 1u > size)
+        return;
+
+    len = payload[0] < sizeof(name) ? payload[0] : sizeof(name) - 1;
+    memcpy(name, &payload[1], len);
+    name[len] = 0;
+
+    pthread_mutex_lock(&fleetLock);
+
+    peer = find_peer(peerId, 1);
+    if (peer)
+    {
+        if (msgCode == SYSTEM_HOUSE_NAME)
+        {
+            set_name(peer, FLEET_HOUSE, name);
+        }
+        else if (msgCode == SYSTEM_ZONE_NAME)
+        {
+            peer->zoneReported = 1;
+            set_name(peer, FLEET_ZONE, name);
+        }
+        else
+        {
+            set_name(peer, FLEET_ROOM, name);
+        }
+
+        /* The configuration may have been downloaded before we have met the device */
+        if (peer->house[0] && peer->room[0] && !config_cache_find_room(peer->house, peer->room, &room))
+            apply_room(peer, &room);
+    }
+
+    pthread_mutex_unlock(&fleetLock);
+}
+
+void fleet_set_connection(const osdg_key_t peerId, osdg_connection_t conn)
+{
+    struct fleet_peer *peer;
+
+    pthread_mutex_lock(&fleetLock);
+
+    peer = find_peer(peerId, conn != NULL);
+    if (peer)
+        peer->conn = conn;
+
+    pthread_mutex_unlock(&fleetLock);
+}
+
+void fleet_apply_config(const struct house_config *cfg)
+{
+    struct fleet_group *house;
+    struct fleet_peer *peer;
+    unsigned int i;
+
+    pthread_mutex_lock(&fleetLock);
+
+    house = find_group(FLEET_HOUSE, cfg->houseName, "", 0);
+
+    for (peer = house ? house->first : NULL; peer; peer = peer->link[FLEET_HOUSE].next)
+    {
+        for (i = 0; i < cfg->numRooms; i++)
+        {
+            if (!strcmp(cfg->rooms[i].name, peer->room))
+            {
+                apply_room(peer, &cfg->rooms[i]);
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&fleetLock);
+}
+
+unsigned int fleet_foreach(enum fleet_key key, const char *house, const char *name, fleet_cb_t cb, void *ctx)
+{
+    struct fleet_group *g;
+    struct fleet_peer *peer;
+    unsigned int n = 0;
+
+    pthread_mutex_lock(&fleetLock);
+
+    g = find_group(key, house, key == FLEET_HOUSE ? "" : name, 0);
+
+    for (peer = g ? g->first : NULL; peer; peer = peer->link[key].next)
+    {
+        cb(peer, ctx);
+        n++;
+    }
+
+    pthread_mutex_unlock(&fleetLock);
+    return n;
+}
@@ -0,0 +1,55 @@
+#ifndef _FLEET_H
+#define _FLEET_H
+
+#include "opensdg.h"
+#include "config_cache.h"
+
+/*
+ * Index of known thermostats by house, zone and room. Names come from the devices
+ * themselves (SYSTEM_HOUSE_NAME, SYSTEM_ZONE_NAME, SYSTEM_ROOM_NAME); zones and
+ * sort order missing there are taken from the house configuration. Every group
+ * is a hash table entry with its own list of members, so group operations
+ * don't have to look at every connection.
+ */
+enum fleet_key
+{
+    FLEET_HOUSE,
+    FLEET_ZONE,  /* Zone names are per house */
+    FLEET_ROOM,  /* Same for rooms */
+    FLEET_KEYS
+};
+
+struct fleet_group;
+
+struct fleet_link
+{
+    struct fleet_group *group;
+    struct fleet_peer  *prev;
+    struct fleet_peer  *next;
+};
+
+struct fleet_peer
+{
+    osdg_key_t         peerId;
+    osdg_connection_t  conn;    /* NULL while offline */
+    char               house[64];
+    char               zone[32];
+    char               room[64];
+    int                sortOrder;
+    int                zoneReported; /* By the device, the configuration doesn't override it */
+    struct fleet_peer *hashNext;
+    struct fleet_link  link[FLEET_KEYS];
+};
+
+/* Called with the index locked, must not call back into fleet_*() */
+typedef void (*fleet_cb_t)(const struct fleet_peer *peer, void *ctx);
+
+/* Picks up name messages, received from the device */
+void fleet_store(const osdg_key_t peerId, unsigned short msgCode, const unsigned char *payload, unsigned int size);
+void fleet_set_connection(const osdg_key_t peerId, osdg_connection_t conn);
+/* Fills in zones of rooms, known by this house */
+void fleet_apply_config(const struct house_config *cfg);
+/* Name is ignored for FLEET_HOUSE; returns number of peers visited */
+unsigned int fleet_foreach(enum fleet_key key, const char *house, const char *name, fleet_cb_t cb, void *ctx);
+
+#endif
@@ -7,9 +7,13 @@
 #include <unistd.h>
 
 #include "opensdg.h"
+#include "config_cache.h"
 #include "testapp.h"
 #include "devismart.h"
 #include "devismart_protocol.h"
+#include "fleet.h"
+#include "outbox.h"
+#include "schedule.h"
 
 static int read_file(void *buffer, int size, const char *name)
 {
@@ -144,6 +148,18 @@ static void peer_status_changed(osdg_connection_t conn, enum osdg_connection_sta
     printf("Peer");
     print_status(conn, status);
 
+    fleet_set_connection(osdg_get_peer_id(conn), status == osdg_connected ? conn : NULL);
+
+    /* The device is back, deliver what has been written while it was away */
+    if (status == osdg_connected) {
+        osdg_result_t res = outbox_flush(conn);
+
+        if (res != osdg_no_error) {
+            printf("Outbox flush failed: ");
+            print_result(res);
+        }
+    }
+
     if (status == osdg_closed) {
         curr_peer = NULL;
         osdg_connection_destroy(conn);
@@ -183,6 +199,25 @@ static osdg_result_t default_peer_receive_data(osdg_connection_t conn, const voi
     return osdg_no_error;
 }
 
+/* Drop packets, consisting of a single message with the given code and payload size */
+static void add_tick_filter(osdg_connection_t peer, enum MsgClass msgClass, enum MsgCode code, unsigned char dataSize)
+{
+    struct osdg_receive_filter filter;
+    struct MsgHeader header;
+
+    header.msgClass = msgClass;
+    header.msgCode  = code;
+    header.dataSize = dataSize;
+
+    memset(&filter, 0, sizeof(filter));
+    filter.length = sizeof(header);
+    filter.size   = sizeof(header) + dataSize;
+    memcpy(filter.value, &header, sizeof(header));
+    memset(filter.mask, 0xFF, sizeof(header));
+
+    osdg_add_receive_filter(peer, &filter);
+}
+
 static void connect_to_peer(osdg_connection_t client)
 {
   const char *protocol = DEVISMART_PROTOCOL_NAME;
@@ -203,6 +238,12 @@ static void connect_to_peer(osdg_connection_t client)
 
   osdg_set_state_change_callback(peer, peer_status_changed);
 
+  /* These are sent every second and we aren't interested in them. NVM_RUNTIME_STATS
+     is also a tick, but its size isn't known, and a size-less filter could drop
+     other messages, merged into the same packet. */
+  add_tick_filter(peer, DOMINION_SYSTEM, SYSTEM_TIME, sizeof(struct DateTime));
+  add_tick_filter(peer, DOMINION_SYSTEM, SYSTEM_TIME_ISVALID, 1);
+
   osdg_result_t err = osdg_set_receive_data_callback(peer, devismart_receive_data);
   if (err) {
       printf("Failed to set data receive callback: ");
@@ -248,6 +289,122 @@ static void pair_remote_peer(osdg_connection_t client, char *argStr)
   }
 }
 
+static void show_house(void)
+{
+    struct house_config *cfg = config_cache_lookup(curr_pairing.peerId, CONFIG_MAX_AGE);
+    unsigned int i;
+
+    if (!cfg) {
+        printf("No fresh configuration cached for this house; pair again to download it\n");
+        return;
+    }
+
+    printf("House %s, %u rooms:\n", cfg->houseName, cfg->numRooms);
+    for (i = 0; i < cfg->numRooms; i++)
+        printf("  %-20s zone %-10s order %d\n", cfg->rooms[i].name, cfg->rooms[i].zone, cfg->rooms[i].sortOrder);
+
+    config_cache_release(cfg);
+}
+
+static void print_fleet_peer(const struct fleet_peer *peer, void *ctx)
+{
+    printf("  %-20s zone %-10s %s ", peer->room[0] ? peer->room : "?", peer->zone[0] ? peer->zone : "?",
+           peer->conn ? "online " : "offline");
+    hexdump(peer->peerId, sizeof(osdg_key_t));
+    putchar('\n');
+}
+
+/* show fleet [zone|room] [name] - thermostats of the current house */
+static void show_fleet(char *argStr)
+{
+    const char *what = getWord(&argStr);
+    const char *name = getWord(&argStr);
+    enum fleet_key key = FLEET_HOUSE;
+
+    if (!strcmp(what, "zone"))
+        key = FLEET_ZONE;
+    else if (!strcmp(what, "room"))
+        key = FLEET_ROOM;
+
+    if (!fleet_foreach(key, curr_pairing.description, name, print_fleet_peer, NULL))
+        printf("No known thermostats\n");
+}
+
+static void show_schedule(void)
+{
+    static const char *days[] = { "Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun" };
+    struct week_schedule sched;
+    unsigned int d, i;
+
+    if (curr_peer == NULL || schedule_get(osdg_get_peer_id(curr_peer), &sched)) {
+        printf("Schedule is not known yet\n");
+        return;
+    }
+
+    for (d = 0; d < 7; d++) {
+        printf("%s", days[d]);
+        for (i = 0; i < sched.days[d].count; i++) {
+            const struct schedule_period *p = &sched.days[d].periods[i];
+
+            printf(" %02u:%02u-%02u:%02u", p->start / 4, p->start % 4 * 15, p->end / 4, p->end % 4 * 15);
+        }
+        putchar('\n');
+    }
+}
+
+/* schedule [day 1-7] [HH:MM-HH:MM ...] - replaces comfort periods of one day */
+static void set_schedule(char *argStr)
+{
+#ifdef SCHEDULE_WRITE
+    struct week_schedule sched;
+    struct schedule_day *day;
+    unsigned int d = strtoul(getWord(&argStr), NULL, 10);
+    int sent;
+
+    if (curr_peer == NULL || osdg_get_connection_state(curr_peer) != osdg_connected) {
+        printf("Not connected to peer\n");
+        return;
+    }
+
+    if (d < 1 || d > 7) {
+        printf("Day must be 1 (Monday) to 7 (Sunday)\n");
+        return;
+    }
+
+    /* Other days are kept as they are */
+    if (schedule_get(osdg_get_peer_id(curr_peer), &sched)) {
+        printf("Schedule is not known yet, wait for the device to report it\n");
+        return;
+    }
+
+    day = &sched.days[d - 1];
+    day->count = 0;
+
+    while (*argStr) {
+        unsigned int h1, m1, h2, m2;
+
+        if (day->count == SCHEDULE_MAX_PERIODS ||
+            sscanf(getWord(&argStr), "%u:%u-%u:%u", &h1, &m1, &h2, &m2) != 4 ||
+            h1 * 60 + m1 >= h2 * 60 + m2 || h2 * 60 + m2 > 24 * 60) {
+            printf("Invalid period list\n");
+            return;
+        }
+
+        day->periods[day->count].start = (h1 * 60 + m1) / 15;
+        day->periods[day->count].end   = (h2 * 60 + m2) / 15;
+        day->count++;
+    }
+
+    sent = schedule_apply(curr_peer, &sched);
+    if (sent < 0)
+        print_client_error(curr_peer);
+    else
+        printf("%d schedule messages sent\n", sent);
+#else
+    printf("Schedule write format is not verified, rebuild with EXPERIMENTAL_SCHEDULE_WRITE to send it anyway\n");
+#endif
+}
+
 static void close_connection()
 {
 	if (curr_peer != NULL) {
@@ -257,12 +414,24 @@ static void close_connection()
 
 static void send_data(char *argStr)
 {
-	if (curr_peer != NULL) {
-		osdg_result_t res = devismart_send(curr_peer, argStr);
+	unsigned char buffer[DEVISMART_MAX_PACKET];
+	unsigned int size = devismart_build_packet(buffer, argStr);
+
+	if (!size)
+		return;
+
+	if (curr_peer != NULL && osdg_get_connection_state(curr_peer) == osdg_connected) {
+		osdg_result_t res = osdg_send_data(curr_peer, buffer, size);
+
+		if (res == osdg_no_error)
+			return;
 
-		if (res != osdg_no_error)
-			print_result(res);
+		print_result(res);
 	}
+
+	/* The device is offline, keep the write until it's back */
+	if (!outbox_put(curr_pairing.peerId, buffer, size))
+		printf("Queued in outbox, %u pending\n", outbox_pending(curr_pairing.peerId));
 }
 
 static void set_ping_interval(osdg_connection_t client, char *argStr)
@@ -372,6 +541,8 @@ int main(int argc, const char *const *argv)
     printf("not yet paired.\n");
   }
 
+  outbox_open("osdg_test_outbox.bin");
+
   client = osdg_connection_create();
   if (!client)
   {
@@ -416,9 +587,14 @@ int main(int argc, const char *const *argv)
                 "grid [connect|disconnect]  - manually control grid connection\n"
                 "show pairing               - show current pairing\n"
                 "show peer                  - show current peer\n"
+                "show schedule              - show current peer's week schedule\n"
+                "show house                 - show cached house configuration\n"
+                "show outbox                - show writes queued for offline peer\n"
+                "show fleet [zone|room] [name] - show thermostats of the house\n"
                 "pair [OTP]                 - pair with the given OTP\n"
                 "ping [interval]            - set grid ping interval in seconds\n"
                 "send [connection #] [data] - send data to a peer\n"
+                "schedule [day] [periods]   - set comfort periods (HH:MM-HH:MM) for a day\n"
                 "quit                       - end session\n"
                 "whoami                     - print own peer information\n");
     }
@@ -449,6 +625,18 @@ int main(int argc, const char *const *argv)
 			hexdump(osdg_get_peer_id(curr_peer), sizeof(osdg_key_t));
 			putchar('\n');
 		}
+        else if (!strcmp(cmd, "schedule")) {
+			show_schedule();
+		}
+        else if (!strcmp(cmd, "house")) {
+			show_house();
+		}
+        else if (!strcmp(cmd, "fleet")) {
+			show_fleet(p);
+		}
+        else if (!strcmp(cmd, "outbox")) {
+			printf("%u writes pending\n", outbox_pending(curr_pairing.peerId));
+		}
         else
         printf("Unknown item %s", cmd);
     }
@@ -460,6 +648,10 @@ int main(int argc, const char *const *argv)
     {
         send_data(p);
     }
+    else if (!strcmp(cmd, "schedule"))
+    {
+        set_schedule(p);
+    }
     else if (!strcmp(cmd, "quit"))
     {
         break;
@@ -480,6 +672,7 @@ int main(int argc, const char *const *argv)
 
   osdg_connection_close(client);
   osdg_connection_destroy(client);
+  outbox_close();
 
   osdg_shutdown();
   return 0;
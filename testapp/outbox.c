@@ -0,0 +1,321 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "devismart_protocol.h"
+#include "outbox.h"
+#include "packer.h"
+
+#define OUTBOX_SIZE  65536
+#define OUTBOX_MAGIC 0x584F424F /* "OBOX" */
+
+enum RecordState
+{
+    RECORD_PENDING = 1,
+    RECORD_DONE    = 2  /* Sent or superseded */
+};
+
+struct OutboxHeader
+{
+    unsigned int magic;
+    unsigned int used;  /* End of the log; records past it are garbage */
+};
+
+struct OutboxRecord
+{
+    osdg_key_t     peerId;
+    unsigned short msgCode;
+    unsigned char  state;
+    unsigned char  reserved;
+    unsigned short size;      /* Packet size, SendMsgHeader included */
+    unsigned char  data[];
+};
+
+#define RECORD_LENGTH(size) ((sizeof(struct OutboxRecord) + (size) + 3) & ~3)
+
+static struct OutboxHeader *outbox;
+static char                 outboxName[256];
+/* Writes come from the console, flushes from the library's state callback */
+static pthread_mutex_t outboxLock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline struct OutboxRecord *first_record(void)
+{
+    return (struct OutboxRecord *)&outbox[1];
+}
+
+static inline struct OutboxRecord *next_record(struct OutboxRecord *r)
+{
+    return (struct OutboxRecord *)((unsigned char *)r + RECORD_LENGTH(r->size));
+}
+
+static inline int is_end(struct OutboxRecord *r)
+{
+    return (unsigned char *)r >= (unsigned char *)outbox + outbox->used;
+}
+
+/* Maps the log file, creating it if needed; returns NULL on failure */
+static struct OutboxHeader *outbox_map(const char *name, int flags)
+{
+    struct OutboxHeader *map;
+    int fd = open(name, O_RDWR | O_CREAT | flags, 0600);
+
+    if (fd == -1)
+        return NULL;
+
+    if (ftruncate(fd, OUTBOX_SIZE))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, OUTBOX_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return map == MAP_FAILED ? NULL : map;
+}
+
+/*
+ * Drop finished records, order preserved. Pending ones are copied into a fresh
+ * file, which replaces the log only once it's complete on disk, so a crash
+ * leaves either the old log or the new one, never a mix of both.
+ */
+static void outbox_compact(void)
+{
+    char tmpName[sizeof(outboxName) + 4];
+    struct OutboxHeader *fresh;
+    unsigned char *dst;
+    struct OutboxRecord *r;
+
+    for (r = first_record(); !is_end(r); r = next_record(r))
+    {
+        if (r->state != RECORD_PENDING)
+            break;
+    }
+
+    if (is_end(r))
+        return; /* Nothing to drop */
+
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", outboxName);
+    fresh = outbox_map(tmpName, O_TRUNC);
+    if (!fresh)
+    {
+        printf("Failed to compact outbox %s\n", outboxName);
+        return;
+    }
+
+    dst = (unsigned char *)&fresh[1];
+    for (r = first_record(); !is_end(r); r = next_record(r))
+    {
+        unsigned int len = RECORD_LENGTH(r->size);
+
+        if (r->state != RECORD_PENDING)
+            continue;
+
+        memcpy(dst, r, len);
+        dst += len;
+    }
+
+    fresh->magic = OUTBOX_MAGIC;
+    fresh->used  = (unsigned int)(dst - (unsigned char *)fresh);
+
+    if (msync(fresh, OUTBOX_SIZE, MS_SYNC) || rename(tmpName, outboxName))
+    {
+        printf("Failed to compact outbox %s\n", outboxName);
+        munmap(fresh, OUTBOX_SIZE);
+        unlink(tmpName);
+        return;
+    }
+
+    munmap(outbox, OUTBOX_SIZE);
+    outbox = fresh;
+}
+
+int outbox_open(const char *name)
+{
+    if (strlen(name) >= sizeof(outboxName))
+    {
+        printf("Outbox name %s is too long\n", name);
+        return -1;
+    }
+
+    strcpy(outboxName, name);
+    outbox = outbox_map(name, 0);
+
+    if (!outbox)
+    {
+        printf("Failed to map outbox %s\n", name);
+        return -1;
+    }
+
+    if (outbox->magic != OUTBOX_MAGIC || outbox->used < sizeof(struct OutboxHeader) || outbox->used > OUTBOX_SIZE)
+    {
+        outbox->magic = OUTBOX_MAGIC;
+        outbox->used  = sizeof(struct OutboxHeader);
+    }
+
+    outbox_compact();
+    return 0;
+}
+
+void outbox_close(void)
+{
+    if (!outbox)
+        return;
+
+    msync(outbox, OUTBOX_SIZE, MS_SYNC);
+    munmap(outbox, OUTBOX_SIZE);
+    outbox = NULL;
+}
+
+int outbox_put(const osdg_key_t peerId, const void *packet, unsigned int size)
+{
+    const struct SendMsgHeader *pkt = packet;
+    unsigned int len = RECORD_LENGTH(size);
+    struct OutboxRecord *r, *added;
+
+    if (!outbox || size < sizeof(struct SendMsgHeader))
+        return -1;
+
+    pthread_mutex_lock(&outboxLock);
+
+    if (outbox->used + len > OUTBOX_SIZE)
+    {
+        outbox_compact();
+        if (outbox->used + len > OUTBOX_SIZE)
+        {
+            pthread_mutex_unlock(&outboxLock);
+            printf("Outbox is full\n");
+            return -1;
+        }
+    }
+
+    added = (struct OutboxRecord *)((unsigned char *)outbox + outbox->used);
+    memcpy(added->peerId, peerId, sizeof(osdg_key_t));
+    added->msgCode  = pkt->header.msgCode;
+    added->state    = RECORD_PENDING;
+    added->reserved = 0;
+    added->size     = size;
+    memcpy(added->data, packet, size);
+
+    /* The record becomes valid only after it's been completely written */
+    __sync_synchronize();
+    outbox->used += len;
+    __sync_synchronize();
+
+    /*
+     * Last write wins. Older records are superseded only after the new one has
+     * been published; if we crash in between, both are replayed in order, which
+     * has the same effect.
+     */
+    for (r = first_record(); r != added; r = next_record(r))
+    {
+        if (r->state == RECORD_PENDING && r->msgCode == pkt->header.msgCode &&
+            !memcmp(r->peerId, peerId, sizeof(osdg_key_t)))
+        {
+            r->state = RECORD_DONE;
+        }
+    }
+
+    msync(outbox, OUTBOX_SIZE, MS_ASYNC);
+
+    pthread_mutex_unlock(&outboxLock);
+    return 0;
+}
+
+/* Mark pending records of the peer in [from, to) as sent; NULL "to" means the end */
+static unsigned int mark_sent(struct OutboxRecord *from, struct OutboxRecord *to, const unsigned char *peerId)
+{
+    struct OutboxRecord *r;
+    unsigned int n = 0;
+
+    for (r = from; r != to && !is_end(r); r = next_record(r))
+    {
+        if (r->state != RECORD_PENDING || memcmp(r->peerId, peerId, sizeof(osdg_key_t)))
+            continue;
+
+        r->state = RECORD_DONE;
+        n++;
+    }
+
+    return n;
+}
+
+osdg_result_t outbox_flush(osdg_connection_t conn)
+{
+    const unsigned char *peerId = osdg_get_peer_id(conn);
+    struct OutboxRecord *r, *batch = NULL;
+    struct msg_packer packer;
+    unsigned int sent = 0;
+    osdg_result_t res = osdg_no_error;
+
+    if (!outbox)
+        return osdg_no_error;
+
+    packer_init(&packer, conn);
+    pthread_mutex_lock(&outboxLock);
+
+    /* Records are packed together; a batch is only marked done once it's actually sent */
+    for (r = first_record(); !is_end(r); r = next_record(r))
+    {
+        if (r->state != RECORD_PENDING || memcmp(r->peerId, peerId, sizeof(osdg_key_t)))
+            continue;
+
+        if (packer.used + r->size > packer.limit)
+        {
+            res = packer_flush(&packer);
+            if (res != osdg_no_error)
+                break; /* Keep the rest for the next time */
+
+            sent += mark_sent(batch, r, peerId);
+            batch = NULL;
+        }
+
+        if (!batch)
+            batch = r;
+
+        res = packer_add(&packer, r->data, r->size);
+        if (res != osdg_no_error)
+            break;
+    }
+
+    if (res == osdg_no_error)
+    {
+        res = packer_flush(&packer);
+        if (res == osdg_no_error && batch)
+            sent += mark_sent(batch, NULL, peerId);
+    }
+
+    if (sent)
+        msync(outbox, OUTBOX_SIZE, MS_ASYNC);
+
+    pthread_mutex_unlock(&outboxLock);
+
+    if (sent)
+        printf("Outbox: %u queued writes sent\n", sent);
+
+    return res;
+}
+
+unsigned int outbox_pending(const osdg_key_t peerId)
+{
+    struct OutboxRecord *r;
+    unsigned int n = 0;
+
+    if (!outbox)
+        return 0;
+
+    pthread_mutex_lock(&outboxLock);
+
+    for (r = first_record(); !is_end(r); r = next_record(r))
+    {
+        if (r->state == RECORD_PENDING && !memcmp(r->peerId, peerId, sizeof(osdg_key_t)))
+            n++;
+    }
+
+    pthread_mutex_unlock(&outboxLock);
+    return n;
+}
@@ -0,0 +1,18 @@
+#ifndef _OUTBOX_H
+#define _OUTBOX_H
+
+#include "opensdg.h"
+
+/*
+ * Durable outbox for writes to offline devices. Packets are appended to a
+ * memory-mapped log file; a newer write with the same MsgCode to the same peer
+ * supersedes the older one, so only the latest value is ever sent.
+ */
+int outbox_open(const char *name);
+void outbox_close(void);
+int outbox_put(const osdg_key_t peerId, const void *packet, unsigned int size);
+/* Sends all pending packets for the connected peer back to back */
+osdg_result_t outbox_flush(osdg_connection_t conn);
+unsigned int outbox_pending(const osdg_key_t peerId);
+
+#endif
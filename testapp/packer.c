@@ -0,0 +1,45 @@
+#include <string.h>
+
+#include "packer.h"
+
+void packer_init(struct msg_packer *p, osdg_connection_t conn)
+{
+    unsigned int max = osdg_get_max_send_size(conn);
+
+    p->conn  = conn;
+    p->limit = max < sizeof(p->buffer) ? max : sizeof(p->buffer);
+    p->used  = 0;
+    p->count = 0;
+}
+
+osdg_result_t packer_add(struct msg_packer *p, const void *packet, unsigned int size)
+{
+    if (size > p->limit)
+        return osdg_buffer_exceeded;
+
+    if (p->used + size > p->limit)
+    {
+        osdg_result_t res = packer_flush(p);
+
+        if (res != osdg_no_error)
+            return res;
+    }
+
+    memcpy(&p->buffer[p->used], packet, size);
+    p->used += size;
+    p->count++;
+    return osdg_no_error;
+}
+
+osdg_result_t packer_flush(struct msg_packer *p)
+{
+    osdg_result_t res;
+
+    if (!p->used)
+        return osdg_no_error;
+
+    res = osdg_send_data(p->conn, p->buffer, p->used);
+    p->used  = 0;
+    p->count = 0;
+    return res;
+}
@@ -0,0 +1,27 @@
+#ifndef _PACKER_H
+#define _PACKER_H
+
+#include "opensdg.h"
+
+#define PACKER_BUFFER_SIZE 1536
+
+/*
+ * Accumulates several dominion-1.0 messages (struct SendMsgHeader with payload)
+ * and sends them as a single MESG, the same way the thermostat merges its own
+ * messages. Saves one encryption and one send() per message.
+ */
+struct msg_packer
+{
+    osdg_connection_t conn;
+    unsigned int      limit;
+    unsigned int      used;
+    unsigned int      count;
+    unsigned char     buffer[PACKER_BUFFER_SIZE];
+};
+
+void packer_init(struct msg_packer *p, osdg_connection_t conn);
+/* Flushes first if the message doesn't fit */
+osdg_result_t packer_add(struct msg_packer *p, const void *packet, unsigned int size);
+osdg_result_t packer_flush(struct msg_packer *p);
+
+#endif
@@ -0,0 +1,221 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "opensdg.h"
+#include "devismart.h"
+#include "devismart_protocol.h"
+#include "packer.h"
+#include "schedule.h"
+
+/*
+ * Wire layout of SCHEDULER_WEEK messages has not been captured from a real
+ * device yet, this is our best guess, following other array types: a length
+ * prefixed array of day records, each one being period count followed by
+ * (start, end) pairs. SCHEDULER_WEEK carries Monday to Thursday,
+ * SCHEDULER_WEEK_2 - Friday to Sunday. Decoding is harmless, but writing is
+ * only built with EXPERIMENTAL_SCHEDULE_WRITE until the layout is verified.
+ */
+static const unsigned short msgCodes[SCHEDULE_MESSAGES] = { SCHEDULER_WEEK, SCHEDULER_WEEK_2 };
+static const unsigned char  firstDay[SCHEDULE_MESSAGES + 1] = { 0, 4, 7 };
+
+#define MAX_PAYLOAD 255
+#define MAX_DEVICES 256
+
+struct schedule_payload
+{
+    unsigned char size; /* 0 if not known */
+    unsigned char data[MAX_PAYLOAD];
+};
+
+struct device_schedule
+{
+    osdg_key_t              peerId;
+    struct schedule_payload msg[SCHEDULE_MESSAGES];
+};
+
+static struct device_schedule devices[MAX_DEVICES];
+static unsigned int numDevices;
+/* Device data arrives on the library's thread, commands come from the console */
+static pthread_mutex_t scheduleLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int msg_index(unsigned short msgCode)
+{
+    unsigned int i;
+
+    for (i = 0; i < SCHEDULE_MESSAGES; i++)
+    {
+        if (msgCodes[i] == msgCode)
+            return i;
+    }
+
+    return -1;
+}
+
+static struct device_schedule *find_device(const osdg_key_t peerId, int create)
+{
+    unsigned int i;
+
+    for (i = 0; i < numDevices; i++)
+    {
+        if (!memcmp(devices[i].peerId, peerId, sizeof(osdg_key_t)))
+            return &devices[i];
+    }
+
+    if (!create || numDevices == MAX_DEVICES)
+        return NULL;
+
+    memset(&devices[numDevices], 0, sizeof(struct device_schedule));
+    memcpy(devices[numDevices].peerId, peerId, sizeof(osdg_key_t));
+    return &devices[numDevices++];
+}
+
+#ifdef SCHEDULE_WRITE
+static void encode(const struct week_schedule *sched, unsigned int idx, struct schedule_payload *out)
+{
+    unsigned char *p = &out->data[1];
+    unsigned int d, i;
+
+    for (d = firstDay[idx]; d < firstDay[idx + 1]; d++)
+    {
+        const struct schedule_day *day = &sched->days[d];
+
+        *p++ = day->count;
+        for (i = 0; i < day->count; i++)
+        {
+            *p++ = day->periods[i].start;
+            *p++ = day->periods[i].end;
+        }
+    }
+
+    out->size = (unsigned char)(p - out->data);
+    out->data[0] = out->size - 1;
+}
+#endif
+
+static int decode(struct week_schedule *sched, unsigned int idx, const struct schedule_payload *in)
+{
+    const unsigned char *p = &in->data[1];
+    const unsigned char *end = &in->data[1] + in->data[0];
+    unsigned int d, i;
+
+    if (!in->size || in->data[0] >= in->size)
+        return -1;
+
+    for (d = firstDay[idx]; d < firstDay[idx + 1]; d++)
+    {
+        struct schedule_day *day = &sched->days[d];
+
+        if (p == end || *p > SCHEDULE_MAX_PERIODS || p + 1 + *p * 2 > end)
+            return -1;
+
+        day->count = *p++;
+        for (i = 0; i < day->count; i++)
+        {
+            day->periods[i].start = *p++;
+            day->periods[i].end   = *p++;
+        }
+    }
+
+    return 0;
+}
+
+void schedule_store(const osdg_key_t peerId, unsigned short msgCode, const unsigned char *payload, unsigned int size)
+{
+    int idx = msg_index(msgCode);
+    struct device_schedule *dev;
+
+    if (idx == -1 || !size || size > MAX_PAYLOAD)
+        return;
+
+    pthread_mutex_lock(&scheduleLock);
+
+    dev = find_device(peerId, 1);
+    if (dev)
+    {
+        memcpy(dev->msg[idx].data, payload, size);
+        dev->msg[idx].size = size;
+    }
+
+    pthread_mutex_unlock(&scheduleLock);
+}
+
+int schedule_get(const osdg_key_t peerId, struct week_schedule *sched)
+{
+    struct device_schedule *dev;
+    unsigned int i;
+    int ret = -1;
+
+    pthread_mutex_lock(&scheduleLock);
+
+    dev = find_device(peerId, 0);
+    if (dev)
+    {
+        for (i = 0, ret = 0; i < SCHEDULE_MESSAGES && !ret; i++)
+            ret = decode(sched, i, &dev->msg[i]);
+    }
+
+    pthread_mutex_unlock(&scheduleLock);
+    return ret;
+}
+
+#ifdef SCHEDULE_WRITE
+int schedule_apply(osdg_connection_t conn, const struct week_schedule *sched)
+{
+    struct schedule_payload msg[SCHEDULE_MESSAGES];
+    struct device_schedule *dev;
+    struct msg_packer packer;
+    unsigned int changed = 0;
+    unsigned int i;
+    int sent = 0;
+
+    for (i = 0; i < SCHEDULE_MESSAGES; i++)
+        encode(sched, i, &msg[i]);
+
+    packer_init(&packer, conn);
+    pthread_mutex_lock(&scheduleLock);
+
+    dev = find_device(osdg_get_peer_id(conn), 1);
+
+    /* All changed messages are packed together, normally a single MESG */
+    for (i = 0; i < SCHEDULE_MESSAGES; i++)
+    {
+        unsigned char buffer[DEVISMART_MAX_PACKET];
+        struct SendMsgHeader *packet = (struct SendMsgHeader *)buffer;
+
+        if (dev && dev->msg[i].size == msg[i].size && !memcmp(dev->msg[i].data, msg[i].data, msg[i].size))
+            continue;
+
+        packet->noPayload       = 0;
+        packet->header.msgClass = DOMINION_SCHEDULER;
+        packet->header.msgCode  = msgCodes[i];
+        packet->header.dataSize = msg[i].size;
+        memcpy(packet->payload, msg[i].data, msg[i].size);
+
+        if (packer_add(&packer, buffer, sizeof(struct SendMsgHeader) + msg[i].size) != osdg_no_error)
+        {
+            pthread_mutex_unlock(&scheduleLock);
+            return -1;
+        }
+
+        changed |= 1 << i;
+        sent++;
+    }
+
+    if (packer_flush(&packer) != osdg_no_error)
+    {
+        pthread_mutex_unlock(&scheduleLock);
+        return -1;
+    }
+
+    /* Assume it's applied; the device will tell us otherwise */
+    for (i = 0; dev && i < SCHEDULE_MESSAGES; i++)
+    {
+        if (changed & (1 << i))
+            dev->msg[i] = msg[i];
+    }
+
+    pthread_mutex_unlock(&scheduleLock);
+    return sent;
+}
+#endif
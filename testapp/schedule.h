@@ -0,0 +1,40 @@
+#ifndef _SCHEDULE_H
+#define _SCHEDULE_H
+
+#include "opensdg.h"
+
+#define SCHEDULE_MAX_PERIODS 5
+#define SCHEDULE_MESSAGES    2  /* SCHEDULER_WEEK and SCHEDULER_WEEK_2 */
+
+/* Comfort period, in quarters of an hour since midnight (0 - 96) */
+struct schedule_period
+{
+    unsigned char start;
+    unsigned char end;
+};
+
+struct schedule_day
+{
+    unsigned char          count;
+    struct schedule_period periods[SCHEDULE_MAX_PERIODS];
+};
+
+/* Monday first, like DateTime.dow */
+struct week_schedule
+{
+    struct schedule_day days[7];
+};
+
+/* Remembers schedule messages, received from the device */
+void schedule_store(const osdg_key_t peerId, unsigned short msgCode, const unsigned char *payload, unsigned int size);
+/* Device's current schedule as last seen; returns -1 if not known yet */
+int schedule_get(const osdg_key_t peerId, struct week_schedule *sched);
+#ifdef SCHEDULE_WRITE
+/*
+ * Sends only messages which differ from the device's current schedule; returns number of messages sent.
+ * Experimental (EXPERIMENTAL_SCHEDULE_WRITE cmake option) until the wire layout is captured.
+ */
+int schedule_apply(osdg_connection_t conn, const struct week_schedule *sched);
+#endif
+
+#endif